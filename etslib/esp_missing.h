@@ -47,6 +47,7 @@ uint8 wifi_get_opmode(void);
 char *wifi_station_get_hostname(void);
 uint32 system_get_time();
 int rand(void);
+unsigned long os_random(void);
 void ets_bzero(void *s, size_t n);
 void ets_delay_us(int us);
 
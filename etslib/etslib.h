@@ -3,8 +3,20 @@
 
 #include "esp_missing.h"
 
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
 int ICACHE_FLASH_ATTR snprintf(char *str, size_t size, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
 void ICACHE_FLASH_ATTR stdout_init(void);
+void ICACHE_FLASH_ATTR stdout_rx_init(uint8 prio);
+int ICACHE_FLASH_ATTR stdout_getc(void);
+uint16 ICACHE_FLASH_ATTR stdout_tx_free(void);
+void ICACHE_FLASH_ATTR log_printf(int lvl, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void ICACHE_FLASH_ATTR log_set_level(int lvl);
+int ICACHE_FLASH_ATTR log_get_level(void);
+uint32 ICACHE_FLASH_ATTR log_dropped(void);
 int ICACHE_FLASH_ATTR strcasecmp(const char *s1, const char *s2);
 int ICACHE_FLASH_ATTR strncasecmp(const char *s1, const char *s2, size_t n);
 char *ICACHE_FLASH_ATTR strdup(const char *s);
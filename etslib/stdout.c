@@ -9,27 +9,196 @@
  * ----------------------------------------------------------------------------
  */
 
+/*
+ * Output is queued in a RAM ring and drained by the UART TX FIFO empty
+ * interrupt, so a printf never spins on the 115200 baud line.  When the
+ * ring is full, log_printf() drops the whole record and counts it.
+ *
+ * Input goes the other way: the RX interrupt empties the FIFO into a
+ * second ring and posts a task, which reads it back with stdout_getc().
+ */
+
 #include <esp8266.h>
 #include <uart_hw.h>
 
-static void ICACHE_FLASH_ATTR
-stdout_uart_txd(char c)
+#define LOG_RING_SIZE 2048 // must be a power of two
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_RECORD_MAX 256
+#define UART_TXFIFO_FILL 126
+#define RX_RING_SIZE 128 // must be a power of two
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+
+static char ring[LOG_RING_SIZE];
+static volatile uint16 ring_head; // advanced by the producer
+static volatile uint16 ring_tail; // advanced by the isr
+static char record[LOG_RECORD_MAX];
+static int level = LOG_INFO; // LOGLEVEL on the console raises it
+static uint32 dropped;
+static char rx_ring[RX_RING_SIZE];
+static volatile uint16 rx_head; // advanced by the isr
+static volatile uint16 rx_tail; // advanced by the task
+static bool rx_enabled;
+static uint8 rx_prio;
+
+static void
+stdout_uart_isr(void *arg)
 {
-	//Wait until there is room in the FIFO
-	while (((READ_PERI_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT) >= 126)
-		;
-	//Send the character
-	WRITE_PERI_REG(UART_FIFO(0), c);
+	uint32 status = READ_PERI_REG(UART_INT_ST(0));
+	uint16 next;
+	int n;
+
+	if (status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST)) {
+		n = (READ_PERI_REG(UART_STATUS(0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
+		while (n--) {
+			next = (rx_head + 1) & RX_RING_MASK;
+			if (next == rx_tail) {
+				//Console can't keep up; the byte is lost
+				READ_PERI_REG(UART_FIFO(0));
+				continue;
+			}
+			rx_ring[rx_head] = READ_PERI_REG(UART_FIFO(0)) & 0xff;
+			rx_head = next;
+		}
+		if (rx_enabled) {
+			system_os_post(rx_prio, 0, 0);
+		}
+	}
+
+	if (status & UART_TXFIFO_EMPTY_INT_ST) {
+		while (ring_tail != ring_head &&
+		       ((READ_PERI_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT) < UART_TXFIFO_FILL) {
+			WRITE_PERI_REG(UART_FIFO(0), ring[ring_tail]);
+			ring_tail = (ring_tail + 1) & LOG_RING_MASK;
+		}
+		if (ring_tail == ring_head) {
+			CLEAR_PERI_REG_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
+		}
+	}
+	WRITE_PERI_REG(UART_INT_CLR(0), status);
+}
+
+static inline uint16
+stdout_ring_free(void)
+{
+	return (ring_tail - ring_head - 1) & LOG_RING_MASK;
+}
+
+static inline void
+stdout_ring_put(char c)
+{
+	ring[ring_head] = c;
+	ring_head = (ring_head + 1) & LOG_RING_MASK;
+}
+
+static inline void
+stdout_kick(void)
+{
+	SET_PERI_REG_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
 }
 
 static void ICACHE_FLASH_ATTR
 stdout_putchar(char c)
 {
-	//convert \n -> \r\n
-	if (c=='\n') {
-		stdout_uart_txd('\r');
+	//convert \n -> \r\n; a raw printf that overruns loses the rest of its line
+	if (stdout_ring_free() < (c == '\n' ? 2 : 1)) {
+		if (c == '\n') {
+			dropped++;
+		}
+		return;
 	}
-	stdout_uart_txd(c);
+	if (c == '\n') {
+		stdout_ring_put('\r');
+	}
+	stdout_ring_put(c);
+	stdout_kick();
+}
+
+void ICACHE_FLASH_ATTR
+log_printf(int lvl, const char *fmt, ...)
+{
+	va_list ap;
+	int i, len, need;
+
+	if (lvl > level) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	len = ets_vsnprintf(record, sizeof(record), fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return;
+	}
+	if ((size_t)len >= sizeof(record)) {
+		len = sizeof(record) - 1;
+		record[len - 1] = '\n';
+	}
+
+	need = len;
+	for (i = 0; i < len; i++) {
+		if (record[i] == '\n') {
+			need++;
+		}
+	}
+	if (stdout_ring_free() < need) {
+		dropped++;
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (record[i] == '\n') {
+			stdout_ring_put('\r');
+		}
+		stdout_ring_put(record[i]);
+	}
+	stdout_kick();
+}
+
+void ICACHE_FLASH_ATTR
+log_set_level(int lvl)
+{
+	level = lvl;
+}
+
+int ICACHE_FLASH_ATTR
+log_get_level(void)
+{
+	return level;
+}
+
+uint32 ICACHE_FLASH_ATTR
+log_dropped(void)
+{
+	return dropped;
+}
+
+//Room left in the tx ring, for callers that pace bulk output themselves
+uint16 ICACHE_FLASH_ATTR
+stdout_tx_free(void)
+{
+	return stdout_ring_free();
+}
+
+int ICACHE_FLASH_ATTR
+stdout_getc(void)
+{
+	char c;
+
+	if (rx_tail == rx_head) {
+		return -1;
+	}
+	c = rx_ring[rx_tail];
+	rx_tail = (rx_tail + 1) & RX_RING_MASK;
+	return (unsigned char)c;
+}
+
+//Post to the task at prio whenever input arrives; the task drains stdout_getc()
+void ICACHE_FLASH_ATTR
+stdout_rx_init(uint8 prio)
+{
+	rx_prio = prio;
+	rx_enabled = true;
+	SET_PERI_REG_MASK(UART_INT_ENA(0), UART_RXFIFO_FULL_INT_ENA|UART_RXFIFO_TOUT_INT_ENA);
 }
 
 void ICACHE_FLASH_ATTR
@@ -50,6 +219,15 @@ stdout_init(void)
 	//Clear pending interrupts
 	WRITE_PERI_REG(UART_INT_CLR(0), 0xffff);
 
+	//Refill the tx fifo once it drains below 16 bytes; hand rx over after
+	//64 bytes or two idle character times, whichever comes first
+	WRITE_PERI_REG(UART_CONF1(0), ((16 & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S)|
+				((64 & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S)|
+				((2 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S)|UART_RX_TOUT_EN);
+	WRITE_PERI_REG(UART_INT_ENA(0), 0);
+	ETS_UART_INTR_ATTACH(stdout_uart_isr, NULL);
+	ETS_UART_INTR_ENABLE();
+
 	//Install our own putchar handler
 	os_install_putc1(stdout_putchar);
 }
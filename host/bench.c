@@ -0,0 +1,378 @@
+#include <esp8266.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "governor.h"
+#include "host.h"
+#include "ircd.h"
+#include "loop.h"
+
+/*
+ * Load generator over the loopback transport.  Simulated clients act in
+ * turn on the virtual clock, so every run sends the same lines at the
+ * same server times; only the costs, read from the wall clock around each
+ * call into the server, differ between runs and builds.  One CSV row per
+ * run, so results can be appended to a file and compared.
+ */
+
+#define BENCH_TEXT 64             // PRIVMSG text length
+#define BENCH_SAMPLES (1 << 22)   // delivery latencies kept for percentiles
+
+enum {
+	ROLE_CHAT,                    // talks in every channel in turn
+	ROLE_JOIN,                    // joins and parts
+	ROLE_RECONNECT,               // quits and comes back
+	ROLE_WHO,                     // WHO and NAMES
+	ROLE_MIX,                     // each client one of the above
+};
+
+static const char *benchScenarios[] = {
+	"chat", "join", "reconnect", "who", "mix", NULL,
+};
+
+typedef struct BenchClient BenchClient;
+struct BenchClient {
+	uint8 role;
+	bool up;                      // false once we quit it
+	bool registered;              // had 001, so a close is a drop
+	uint32 turn;
+	char pong[64];
+};
+
+typedef struct Bench Bench;
+struct Bench {
+	int scenario;
+	int clients;
+	int chans;
+	int rate;                     // actions per client per second
+	int seconds;
+	BenchClient client[LOOP_CONNS];
+	uint64_t call_ns;             // start of the current call into the server
+	uint64_t busy_ns;
+	bool measuring;
+	uint32 sent;
+	uint64_t lines;
+	uint64_t bytes;
+	uint32 *lat;                  // nanoseconds
+	uint32 nlat;
+	uint32 refused;
+	uint32 drops;
+};
+
+static Bench bench = {
+	.scenario = ROLE_CHAT,
+	.clients = MAX_USERS,
+	.chans = 2,
+	.rate = 1,
+	.seconds = 60,
+};
+
+static uint64_t
+benchNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// every line a client receives; PINGs are answered after the call returns
+static void
+benchSink(int id, const char *data, int len)
+{
+	const char *end = data + len, *eol, *sp;
+	uint64_t now = benchNs();
+	int n;
+
+	for (; data < end; data = eol + 1) {
+		eol = memchr(data, '\n', end - data);
+		if (!eol) {
+			eol = end;
+		}
+		n = eol - data;
+		if (n && data[n - 1] == '\r') {
+			n--;
+		}
+
+		sp = memchr(data, ' ', n);
+		if (sp && eol - sp > 5 && strncmp(sp, " 001 ", 5) == 0) {
+			bench.client[id].registered = true;
+		}
+		if (n > 5 && strncmp(data, "PING ", 5) == 0) {
+			snprintf(bench.client[id].pong, sizeof(bench.client[id].pong),
+			         "PONG %.*s", n - 5, data + 5);
+		}
+
+		if (!bench.measuring) {
+			continue;
+		}
+		bench.lines++;
+		bench.bytes += (eol < end ? eol + 1 : end) - data;
+		if (bench.nlat < BENCH_SAMPLES) {
+			bench.lat[bench.nlat++] = now - bench.call_ns > 0xffffffff ?
+			                          0xffffffff : now - bench.call_ns;
+		}
+	}
+}
+
+static void
+benchEnter(void)
+{
+	bench.call_ns = benchNs();
+}
+
+static void
+benchLeave(void)
+{
+	bench.busy_ns += benchNs() - bench.call_ns;
+}
+
+static void
+benchSend(int id, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void
+benchSend(int id, const char *fmt, ...)
+{
+	char buf[MSGLEN + 2];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+	va_end(ap);
+	if (len > (int)sizeof(buf) - 3) {
+		len = sizeof(buf) - 3;
+	}
+	memcpy(buf + len, "\r\n", 2);
+
+	if (bench.measuring) {
+		bench.sent++;
+	}
+	benchEnter();
+	loopSend(id, buf, len + 2);
+	benchLeave();
+}
+
+static void
+benchPongs(void)
+{
+	int i;
+
+	for (i = 0; i < bench.clients; i++) {
+		if (bench.client[i].pong[0] && loopOpen(i)) {
+			benchSend(i, "%s", bench.client[i].pong);
+		}
+		bench.client[i].pong[0] = '\0';
+	}
+}
+
+static void
+benchAdvance(uint32 ms)
+{
+	benchEnter();
+	loopAdvance(ms);
+	benchLeave();
+	benchPongs();
+}
+
+static void
+benchConnect(int id)
+{
+	BenchClient *client = &bench.client[id];
+	char chans[MSGLEN];
+	int i, len = 0;
+	bool ok;
+
+	benchEnter();
+	ok = loopConnect(id, 6667);
+	benchLeave();
+	if (!ok) {
+		bench.refused++;
+		return;
+	}
+
+	client->up = true;
+	client->registered = false;
+	benchSend(id, "NICK b%d", id);
+	benchSend(id, "USER b%d 0 * :bench client %d", id, id);
+
+	if (client->role == ROLE_JOIN) {
+		return;
+	}
+	for (i = 0; i < bench.chans && len < (int)sizeof(chans) - 16; i++) {
+		len += snprintf(chans + len, sizeof(chans) - len, "%s#c%d",
+		                i ? "," : "", i);
+	}
+	benchSend(id, "JOIN %s", chans);
+}
+
+static void
+benchAct(int id)
+{
+	BenchClient *client = &bench.client[id];
+	uint32 turn = client->turn++;
+	int chan = turn % bench.chans;
+
+	if (!loopOpen(id)) {
+		if (client->up && client->registered) {
+			bench.drops++;
+		} else if (client->up) {
+			bench.refused++;
+		}
+		client->up = false;
+		benchConnect(id);
+		return;
+	}
+
+	switch (client->role) {
+	case ROLE_CHAT:
+		benchSend(id, "PRIVMSG #c%d :%0*u", chan, BENCH_TEXT,
+		          (unsigned int)turn);
+		break;
+	case ROLE_JOIN:
+		chan = turn / 2 % bench.chans;
+		benchSend(id, "%s #c%d", turn & 1 ? "PART" : "JOIN", chan);
+		break;
+	case ROLE_RECONNECT:
+		client->up = false;
+		benchSend(id, "QUIT :bench");
+		break;
+	case ROLE_WHO:
+		chan = turn / 2 % bench.chans;
+		benchSend(id, "%s #c%d", turn & 1 ? "NAMES" : "WHO", chan);
+		break;
+	}
+}
+
+static int
+benchCompare(const void *a, const void *b)
+{
+	uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+benchPercentile(int p)
+{
+	if (!bench.nlat) {
+		return 0;
+	}
+	return bench.lat[(uint64_t)(bench.nlat - 1) * p / 100] / 1000.0;
+}
+
+static void
+benchReport(bool header)
+{
+	struct rusage ru;
+	double busy = bench.busy_ns / 1e9;
+
+	qsort(bench.lat, bench.nlat, sizeof(bench.lat[0]), benchCompare);
+	getrusage(RUSAGE_SELF, &ru);
+
+	if (header) {
+		printf("scenario,clients,channels,rate,seconds,sent,delivered,"
+		       "msgs_per_sec,bytes_per_msg,p50_us,p99_us,stack_peak,"
+		       "scratch_peak,rss_kb,refused,drops\n");
+	}
+	printf("%s,%d,%d,%d,%d,%u,%llu,%.0f,%.1f,%.2f,%.2f,%u,%u,%ld,%u,%u\n",
+	       benchScenarios[bench.scenario], bench.clients, bench.chans,
+	       bench.rate, bench.seconds, (unsigned int)bench.sent,
+	       (unsigned long long)bench.lines,
+	       busy > 0 ? bench.lines / busy : 0,
+	       bench.lines ? (double)bench.bytes / bench.lines : 0,
+	       benchPercentile(50), benchPercentile(99),
+	       (unsigned int)ircdStackPeak(), (unsigned int)ircdScratchPeak(),
+	       ru.ru_maxrss, (unsigned int)bench.refused,
+	       (unsigned int)bench.drops);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s chat|join|reconnect|who|mix] "
+	        "[-c clients] [-n channels]\n"
+	        "       [-r actions/client/s] [-d seconds] [-l 0-3] [-H] "
+	        "[-t trace.json]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t tick_us, due_us = 0;
+	uint32 actions, i;
+	const char *trace = NULL;
+	bool header = true;
+	int opt, n;
+
+	log_set_level(LOG_ERROR);
+	while ((opt = getopt(argc, argv, "s:c:n:r:d:l:Ht:")) != -1) {
+		switch (opt) {
+		case 's':
+			for (n = 0; benchScenarios[n]; n++) {
+				if (strcmp(optarg, benchScenarios[n]) == 0) {
+					break;
+				}
+			}
+			if (!benchScenarios[n]) {
+				usage(argv[0]);
+			}
+			bench.scenario = n;
+			break;
+		case 'c': bench.clients = atoi(optarg); break;
+		case 'n': bench.chans = atoi(optarg); break;
+		case 'r': bench.rate = atoi(optarg); break;
+		case 'd': bench.seconds = atoi(optarg); break;
+		case 'l': log_set_level(atoi(optarg)); break;
+		case 'H': header = false; break;
+		case 't': trace = optarg; break;
+		default:  usage(argv[0]);
+		}
+	}
+	if (bench.clients < 1 || bench.clients > LOOP_CONNS ||
+	    bench.chans < 1 || bench.rate < 1 || bench.seconds < 1) {
+		usage(argv[0]);
+	}
+	if (trace && !hostTraceTo(trace)) {
+		return 1;
+	}
+
+	bench.lat = malloc(BENCH_SAMPLES * sizeof(bench.lat[0]));
+	if (!bench.lat) {
+		perror("malloc");
+		return 1;
+	}
+
+	srandom(1);
+	loopSetSink(benchSink);
+	govInit(NULL);
+	ircdInit(6667);
+
+	for (n = 0; n < bench.clients; n++) {
+		bench.client[n].role = bench.scenario == ROLE_MIX ? n % ROLE_MIX :
+		                       bench.scenario;
+		benchConnect(n);
+		benchAdvance(100);
+	}
+	benchAdvance(1000);
+
+	// actions are spread evenly over each second, clients in turn
+	bench.measuring = true;
+	tick_us = 1000000 / (bench.clients * bench.rate);
+	actions = bench.seconds * bench.clients * bench.rate;
+	for (i = 0; i < actions; i++) {
+		benchAct(i % bench.clients);
+		benchPongs();
+		due_us += tick_us;
+		if (due_us >= 1000) {
+			benchAdvance(due_us / 1000);
+			due_us %= 1000;
+		}
+	}
+	bench.measuring = false;
+
+	benchReport(header);
+	return 0;
+}
@@ -0,0 +1,179 @@
+// Host stand-in for the combined esp8266 include file
+
+#ifndef HOST_ESP8266_H
+#define HOST_ESP8266_H
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) ((uint8 *)(ipaddr))[0], ((uint8 *)(ipaddr))[1], \
+	((uint8 *)(ipaddr))[2], ((uint8 *)(ipaddr))[3]
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// reported by system_get_free_heap_size(); the host has no such limit
+#define HOST_HEAP_SIZE 40960
+
+/* timers and tasks */
+
+typedef void ETSTimerFunc(void *timer_arg);
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *timer_next;
+	uint32 timer_expire;
+	uint32 timer_period;
+	ETSTimerFunc *timer_func;
+	void *timer_arg;
+} ETSTimer;
+
+typedef uint32 ETSSignal;
+typedef uint32 ETSParam;
+typedef struct ETSEventTag {
+	ETSSignal sig;
+	ETSParam par;
+} ETSEvent;
+typedef ETSEvent os_event_t;
+typedef void (*os_task_t)(os_event_t *e);
+
+void os_timer_arm(ETSTimer *timer, uint32 ms, bool repeat);
+void os_timer_disarm(ETSTimer *timer);
+void os_timer_setfn(ETSTimer *timer, ETSTimerFunc *fn, void *arg);
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen);
+bool system_os_post(uint8 prio, ETSSignal sig, ETSParam par);
+uint32 system_get_time(void);
+uint32 system_get_free_heap_size(void);
+uint8 system_get_cpu_freq(void);
+bool system_update_cpu_freq(uint8 mhz);
+unsigned long os_random(void);
+char *wifi_station_get_hostname(void);
+
+/* espconn, TCP only */
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata,
+	unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+
+enum espconn_type {
+	ESPCONN_INVALID = 0,
+	ESPCONN_TCP = 0x10,
+	ESPCONN_UDP = 0x20,
+};
+
+enum espconn_state {
+	ESPCONN_NONE,
+	ESPCONN_WAIT,
+	ESPCONN_LISTEN,
+	ESPCONN_CONNECT,
+	ESPCONN_WRITE,
+	ESPCONN_READ,
+	ESPCONN_CLOSE,
+};
+
+typedef struct _esp_tcp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+	espconn_connect_callback connect_callback;
+	espconn_reconnect_callback reconnect_callback;
+	espconn_connect_callback disconnect_callback;
+	espconn_connect_callback write_finish_fn;
+} esp_tcp;
+
+struct espconn {
+	enum espconn_type type;
+	enum espconn_state state;
+	union {
+		esp_tcp *tcp;
+		void *udp;
+	} proto;
+	espconn_recv_callback recv_callback;
+	espconn_sent_callback sent_callback;
+	uint8 link_cnt;
+	void *reverse;
+};
+
+enum espconn_option {
+	ESPCONN_START = 0x00,
+	ESPCONN_REUSEADDR = 0x01,
+	ESPCONN_NODELAY = 0x02,
+	ESPCONN_COPY = 0x04,
+	ESPCONN_KEEPALIVE = 0x08,
+	ESPCONN_END,
+};
+
+enum espconn_level {
+	ESPCONN_KEEPIDLE,
+	ESPCONN_KEEPINTVL,
+	ESPCONN_KEEPCNT,
+};
+
+#define ESPCONN_OK 0
+#define ESPCONN_MEM -1
+#define ESPCONN_TIMEOUT -3
+#define ESPCONN_RTE -4
+#define ESPCONN_INPROGRESS -5
+#define ESPCONN_MAXNUM -7
+#define ESPCONN_ABRT -8
+#define ESPCONN_RST -9
+#define ESPCONN_CLSD -10
+#define ESPCONN_CONN -11
+#define ESPCONN_ARG -12
+
+sint8 espconn_accept(struct espconn *conn);
+sint8 espconn_sent(struct espconn *conn, uint8 *data, uint16 len);
+sint8 espconn_disconnect(struct espconn *conn);
+sint8 espconn_regist_connectcb(struct espconn *conn,
+	espconn_connect_callback cb);
+sint8 espconn_regist_recvcb(struct espconn *conn, espconn_recv_callback cb);
+sint8 espconn_regist_sentcb(struct espconn *conn, espconn_sent_callback cb);
+sint8 espconn_regist_disconcb(struct espconn *conn,
+	espconn_connect_callback cb);
+sint8 espconn_regist_reconcb(struct espconn *conn,
+	espconn_reconnect_callback cb);
+sint8 espconn_regist_time(struct espconn *conn, uint32 interval,
+	uint8 type_flag);
+sint8 espconn_tcp_set_max_con(uint8 num);
+uint8 espconn_tcp_get_max_con(void);
+sint8 espconn_tcp_set_max_con_allow(struct espconn *conn, uint8 num);
+sint8 espconn_set_opt(struct espconn *conn, uint8 opt);
+sint8 espconn_set_keepalive(struct espconn *conn, uint8 level, void *optarg);
+sint8 espconn_recv_hold(struct espconn *conn);
+sint8 espconn_recv_unhold(struct espconn *conn);
+
+/* etslib */
+
+void stdout_init(void);
+void stdout_rx_init(uint8 prio);
+int stdout_getc(void);
+uint16 stdout_tx_free(void);
+void log_printf(int lvl, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void log_set_level(int lvl);
+int log_get_level(void);
+uint32 log_dropped(void);
+
+#endif /* HOST_ESP8266_H */
@@ -0,0 +1,175 @@
+#include <esp8266.h>
+#include "governor.h"
+#include "host.h"
+
+/*
+ * Drives the clock governor through busy and idle periods on a fake clock
+ * and checks the frequency it picks after each.  Time only moves when the
+ * driver says so, and the governor's timer fires on the way as it would
+ * between events on the chip.  Prints one line per check and exits
+ * non-zero if any failed.
+ */
+
+typedef struct Fake Fake;
+struct Fake {
+	uint64_t now;             // microseconds
+	uint8 mhz;
+	bool refuse;              // setFreq fails, as the SDK may
+	int failed;
+};
+
+static Fake fake = {
+	.mhz = GOV_HIGH_MHZ,      // govInit() has to bring it down
+};
+
+uint32
+system_get_time(void)
+{
+	return fake.now;
+}
+
+uint32
+hostMillis(void)
+{
+	return fake.now / 1000;
+}
+
+void
+hostNetWatchStdin(void)
+{
+}
+
+static uint32
+fakeTime(void)
+{
+	return fake.now;
+}
+
+static uint8
+fakeGetFreq(void)
+{
+	return fake.mhz;
+}
+
+static bool
+fakeSetFreq(uint8 mhz)
+{
+	if (fake.refuse) {
+		return false;
+	}
+	fake.mhz = mhz;
+	return true;
+}
+
+static const GovClock fakeClock = {
+	fakeTime,
+	fakeGetFreq,
+	fakeSetFreq,
+};
+
+// moves the clock on, running the timers that fall due on the way
+static void
+idle(uint32 ms)
+{
+	uint64_t end = fake.now + ms * 1000ULL;
+	int wait;
+
+	while ((wait = hostTimerWait()) >= 0 &&
+	       fake.now + wait * 1000ULL <= end) {
+		fake.now += wait * 1000ULL;
+		hostTimersRun();
+	}
+	fake.now = end;
+}
+
+static void
+event(uint32 busy_us, uint16 lines)
+{
+	govEventEnter();
+	fake.now += busy_us;
+	govEventLeave(lines);
+}
+
+/*
+ * ms of traffic: an event every period_ms, busy for busy_pct of it and
+ * queueing lines each time.
+ */
+static void
+traffic(uint32 ms, uint32 period_ms, uint32 busy_pct, uint16 lines)
+{
+	uint32 busy = period_ms * 10 * busy_pct;
+	uint32 t;
+
+	for (t = 0; t < ms; t += period_ms) {
+		event(busy, lines);
+		idle(period_ms - busy / 1000);
+	}
+}
+
+static void
+check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) {
+		fake.failed++;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32 switches;
+
+	log_set_level(LOG_ERROR);
+	govInit(&fakeClock);
+	check(fake.mhz == GOV_LOW_MHZ, "starts low");
+
+	traffic(2000, 100, 2, 1);
+	check(fake.mhz == GOV_LOW_MHZ, "light traffic stays low");
+
+	// under the per-window busy threshold in every window
+	traffic(2000, 50, GOV_UP_BUSY_PCT - 5, 0);
+	check(fake.mhz == GOV_LOW_MHZ, "just under the threshold stays low");
+
+	idle(1000);
+	traffic(GOV_WINDOW_MS, 50, GOV_UP_BUSY_PCT + 10, 0);
+	check(fake.mhz == GOV_HIGH_MHZ, "a busy window steps up");
+
+	traffic(3000, 50, GOV_UP_BUSY_PCT + 10, 0);
+	check(fake.mhz == GOV_HIGH_MHZ, "sustained load stays high");
+
+	idle(GOV_WINDOW_MS * (GOV_DOWN_WINDOWS - 1));
+	check(fake.mhz == GOV_HIGH_MHZ, "a short lull stays high");
+
+	traffic(GOV_WINDOW_MS, 50, GOV_UP_BUSY_PCT + 10, 0);
+	idle(GOV_WINDOW_MS * (GOV_DOWN_WINDOWS - 1));
+	check(fake.mhz == GOV_HIGH_MHZ, "load in between starts over");
+
+	idle(GOV_WINDOW_MS * 2);
+	check(fake.mhz == GOV_LOW_MHZ, "quiet windows in a row step down");
+
+	// nothing to wake an idle server at the low clock
+	check(hostTimerWait() < 0, "no timer at the low clock");
+
+	// fan-out: little CPU time, but many lines inside one window
+	idle(1000);
+	event(100, GOV_UP_LINES);
+	check(fake.mhz == GOV_HIGH_MHZ, "a burst of lines steps up at once");
+
+	idle(GOV_WINDOW_MS * (GOV_DOWN_WINDOWS + 1));
+	check(fake.mhz == GOV_LOW_MHZ, "and back down when it is over");
+
+	// the SDK may refuse a switch; the next busy window tries again
+	switches = govSwitches();
+	fake.refuse = true;
+	traffic(GOV_WINDOW_MS * 2, 50, GOV_UP_BUSY_PCT + 10, 0);
+	check(fake.mhz == GOV_LOW_MHZ, "a refused switch leaves the clock");
+	check(govSwitches() == switches, "refused switches are not counted");
+	fake.refuse = false;
+	traffic(GOV_WINDOW_MS, 50, GOV_UP_BUSY_PCT + 10, 0);
+	check(fake.mhz == GOV_HIGH_MHZ, "the next busy window switches");
+
+	printf("%u switches, %d failed\n", (unsigned int)govSwitches(),
+	       fake.failed);
+	return fake.failed != 0;
+}
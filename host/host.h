@@ -0,0 +1,30 @@
+#ifndef HOST_H
+#define HOST_H
+
+#define HOST_MSS 1460       // largest read handed to a recv callback
+#define HOST_SENDQ 65536    // unsent bytes per connection before ESPCONN_MEM
+#define HOST_SENDS 64       // espconn_sent() calls awaiting their sent callback
+#define HOST_TASK_QUEUE 16
+
+// os.c: timers and posted tasks, driven by the transport's loop
+int hostTimerWait(void);
+void hostTimersRun(void);
+bool hostTasksRun(void);
+bool hostStdinReady(void);
+
+// net.c: sockets, the wall clock and the loop
+uint32 hostMillis(void);  // for timers; system_get_time() wraps too soon
+void hostRun(void);
+void hostStop(void);
+void hostNetInit(void);
+void hostNetPoll(int timeout_ms);
+void hostNetFlush(void);
+
+// from stdout_rx_init(); the loopback transport has no console
+void hostNetWatchStdin(void);
+
+// tracefile.c: trace from now on into path, written at exit; false if
+// tracing is not built in
+bool hostTraceTo(const char *path);
+
+#endif /* HOST_H */
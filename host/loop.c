@@ -0,0 +1,461 @@
+#include <esp8266.h>
+#include "host.h"
+#include "loop.h"
+
+/*
+ * espconn over memory, with a virtual clock.  Nothing here depends on
+ * the wall clock or the kernel, so the same calls produce the same bytes
+ * on every run.  Output is captured per connection as it is sent, and
+ * the sent callbacks, input and closes are worked through in connection
+ * order by loopRun() after the callback that caused them returns, as
+ * net.c does with real sockets.
+ */
+
+typedef struct LoopListener LoopListener;
+struct LoopListener {
+	struct espconn *conn;
+	uint8 max_allow;
+	uint8 clients;
+};
+
+typedef struct LoopConn LoopConn;
+struct LoopConn {
+	struct espconn conn;
+	esp_tcp tcp;
+	LoopListener *listener;
+	char *in;
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	uint8 sends;              // espconn_sent() calls awaiting their callback
+	bool open;
+	bool held;
+	bool closing;
+};
+
+typedef struct Loop Loop;
+struct Loop {
+	uint64_t now;             // microseconds
+	LoopListener listeners[LOOP_LISTENERS];
+	LoopConn conns[LOOP_CONNS];
+	LoopSink *sink;
+	uint8 max_con;
+	uint8 conns_open;
+};
+
+static Loop loop = {
+	.max_con = 5,
+};
+
+uint32
+system_get_time(void)
+{
+	return loop.now;
+}
+
+uint32
+hostMillis(void)
+{
+	return loop.now / 1000;
+}
+
+void
+hostNetWatchStdin(void)
+{
+}
+
+static LoopConn *
+loopFind(struct espconn *conn)
+{
+	LoopConn *c;
+	int i;
+
+	for (i = 0; i < LOOP_CONNS; i++) {
+		c = &loop.conns[i];
+		if (!c->open) {
+			continue;
+		}
+		if (conn == &c->conn) {
+			return c;
+		}
+		if (conn == c->listener->conn &&
+		    memcmp(c->tcp.remote_ip, conn->proto.tcp->remote_ip, 4) == 0 &&
+		    c->tcp.remote_port == conn->proto.tcp->remote_port) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static LoopListener *
+loopListener(struct espconn *conn)
+{
+	int i;
+
+	for (i = 0; i < LOOP_LISTENERS; i++) {
+		if (loop.listeners[i].conn == conn) {
+			return &loop.listeners[i];
+		}
+	}
+	return NULL;
+}
+
+// the SDK reports a peer close through disconcb and errors through reconcb
+static void
+loopShut(LoopConn *c, sint8 err)
+{
+	c->open = false;
+	c->listener->clients--;
+	loop.conns_open--;
+	free(c->in);
+	c->in = NULL;
+	c->in_len = 0;
+
+	if (err == ESPCONN_OK) {
+		if (c->tcp.disconnect_callback) {
+			c->tcp.disconnect_callback(&c->conn);
+		}
+	} else if (c->tcp.reconnect_callback) {
+		c->tcp.reconnect_callback(&c->conn, err);
+	}
+}
+
+static void
+loopAppend(char **buf, size_t *len, const char *data, size_t n)
+{
+	*buf = realloc(*buf, *len + n);
+	if (!*buf) {
+		perror("realloc");
+		exit(1);
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+/*
+ * Tasks, sent callbacks, input and deferred closes until none are left.
+ * Each pass gives every connection one turn, lowest id first, and input
+ * goes in at most HOST_MSS bytes a turn, so one client's flood is
+ * interleaved with the others much as a network would.
+ */
+static void
+loopRun(void)
+{
+	LoopConn *c;
+	char buf[HOST_MSS];
+	bool busy = true;
+	int i, n;
+
+	while (busy) {
+		busy = hostTasksRun();
+		for (i = 0; i < LOOP_CONNS; i++) {
+			c = &loop.conns[i];
+			if (!c->open) {
+				continue;
+			}
+
+			while (c->sends && c->open) {
+				c->sends--;
+				busy = true;
+				if (c->conn.sent_callback) {
+					c->conn.sent_callback(&c->conn);
+				}
+			}
+			if (c->open && c->closing && !c->sends) {
+				loopShut(c, ESPCONN_OK);
+				busy = true;
+				continue;
+			}
+
+			if (c->open && !c->held && !c->closing && c->in_len) {
+				n = c->in_len < sizeof(buf) ? c->in_len : sizeof(buf);
+				memcpy(buf, c->in, n);
+				memmove(c->in, c->in + n, c->in_len - n);
+				c->in_len -= n;
+				busy = true;
+				if (c->conn.recv_callback) {
+					c->conn.recv_callback(&c->conn, buf, n);
+				}
+			}
+		}
+	}
+}
+
+/* the driver's side */
+
+// false if the port has no listener or the connection limits refuse it
+bool
+loopConnect(int id, int port)
+{
+	LoopListener *l = NULL;
+	LoopConn *c = &loop.conns[id];
+	int i;
+
+	if (c->open) {
+		return false;
+	}
+	for (i = 0; i < LOOP_LISTENERS; i++) {
+		if (loop.listeners[i].conn &&
+		    loop.listeners[i].conn->proto.tcp->local_port == port) {
+			l = &loop.listeners[i];
+		}
+	}
+	if (!l || loop.conns_open >= loop.max_con || l->clients >= l->max_allow) {
+		return false;
+	}
+
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->listener = l;
+	c->conn = *l->conn;
+	c->conn.proto.tcp = &c->tcp;
+	c->conn.recv_callback = NULL;
+	c->conn.sent_callback = NULL;
+	c->tcp = *l->conn->proto.tcp;
+	c->tcp.remote_ip[0] = 10;
+	c->tcp.remote_ip[1] = 0;
+	c->tcp.remote_ip[2] = id >> 8;
+	c->tcp.remote_ip[3] = (id & 0xff) + 1;
+	c->tcp.remote_port = 49152 + id;
+	c->tcp.disconnect_callback = NULL;
+	c->tcp.reconnect_callback = NULL;
+	c->open = true;
+	l->clients++;
+	loop.conns_open++;
+
+	if (l->conn->proto.tcp->connect_callback) {
+		l->conn->proto.tcp->connect_callback(&c->conn);
+	}
+	loopRun();
+	return true;
+}
+
+void
+loopSend(int id, const char *data, int len)
+{
+	LoopConn *c = &loop.conns[id];
+
+	if (!c->open) {
+		return;
+	}
+
+	loopAppend(&c->in, &c->in_len, data, len);
+	loopRun();
+}
+
+// the client closes its end
+void
+loopClose(int id)
+{
+	LoopConn *c = &loop.conns[id];
+
+	if (!c->open) {
+		return;
+	}
+
+	loopShut(c, ESPCONN_OK);
+	loopRun();
+}
+
+bool
+loopOpen(int id)
+{
+	return loop.conns[id].open;
+}
+
+const char *
+loopOutput(int id, int *len)
+{
+	*len = loop.conns[id].out_len;
+	return loop.conns[id].out;
+}
+
+void
+loopDrain(int id)
+{
+	loop.conns[id].out_len = 0;
+}
+
+// moves the clock on, stopping at each timer that falls due on the way
+void
+loopAdvance(uint32 ms)
+{
+	uint64_t end = loop.now + ms * 1000ULL;
+	int wait;
+
+	while ((wait = hostTimerWait()) >= 0 &&
+	       loop.now + wait * 1000ULL <= end) {
+		loop.now += wait * 1000ULL;
+		hostTimersRun();
+		loopRun();
+	}
+	loop.now = end;
+}
+
+void
+loopSetSink(LoopSink *sink)
+{
+	loop.sink = sink;
+}
+
+/* the SDK calls */
+
+sint8
+espconn_accept(struct espconn *conn)
+{
+	int i;
+
+	for (i = 0; i < LOOP_LISTENERS; i++) {
+		if (!loop.listeners[i].conn) {
+			loop.listeners[i].conn = conn;
+			loop.listeners[i].max_allow = 0xff;
+			conn->state = ESPCONN_LISTEN;
+			return ESPCONN_OK;
+		}
+	}
+	return ESPCONN_MEM;
+}
+
+sint8
+espconn_sent(struct espconn *conn, uint8 *data, uint16 len)
+{
+	LoopConn *c = loopFind(conn);
+
+	if (!c || c->closing) {
+		return ESPCONN_ARG;
+	}
+	if (c->sends == HOST_SENDS) {
+		return ESPCONN_MAXNUM;
+	}
+
+	if (loop.sink) {
+		loop.sink(c - loop.conns, (const char *)data, len);
+	} else {
+		loopAppend(&c->out, &c->out_len, (const char *)data, len);
+	}
+	c->sends++;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_disconnect(struct espconn *conn)
+{
+	LoopConn *c = loopFind(conn);
+
+	if (!c) {
+		return ESPCONN_ARG;
+	}
+
+	c->closing = true;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_connectcb(struct espconn *conn, espconn_connect_callback cb)
+{
+	conn->proto.tcp->connect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_recvcb(struct espconn *conn, espconn_recv_callback cb)
+{
+	conn->recv_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_sentcb(struct espconn *conn, espconn_sent_callback cb)
+{
+	conn->sent_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_disconcb(struct espconn *conn, espconn_connect_callback cb)
+{
+	conn->proto.tcp->disconnect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_reconcb(struct espconn *conn, espconn_reconnect_callback cb)
+{
+	conn->proto.tcp->reconnect_callback = cb;
+	return ESPCONN_OK;
+}
+
+// the server runs its own timeouts; the SDK idle timer is not modelled
+sint8
+espconn_regist_time(struct espconn *conn, uint32 interval, uint8 type_flag)
+{
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_tcp_set_max_con(uint8 num)
+{
+	loop.max_con = num;
+	return ESPCONN_OK;
+}
+
+uint8
+espconn_tcp_get_max_con(void)
+{
+	return loop.max_con;
+}
+
+sint8
+espconn_tcp_set_max_con_allow(struct espconn *conn, uint8 num)
+{
+	LoopListener *l = loopListener(conn);
+
+	if (!l) {
+		return ESPCONN_ARG;
+	}
+
+	l->max_allow = num;
+	return ESPCONN_OK;
+}
+
+// no TCP keepalive here, so the server falls back to PINGs on the clock
+sint8
+espconn_set_opt(struct espconn *conn, uint8 opt)
+{
+	if (!loopFind(conn) || (opt & ESPCONN_KEEPALIVE)) {
+		return ESPCONN_ARG;
+	}
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_set_keepalive(struct espconn *conn, uint8 level, void *optarg)
+{
+	return ESPCONN_ARG;
+}
+
+sint8
+espconn_recv_hold(struct espconn *conn)
+{
+	LoopConn *c = loopFind(conn);
+
+	if (!c) {
+		return ESPCONN_ARG;
+	}
+
+	c->held = true;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_recv_unhold(struct espconn *conn)
+{
+	LoopConn *c = loopFind(conn);
+
+	if (!c) {
+		return ESPCONN_ARG;
+	}
+
+	c->held = false;
+	return ESPCONN_OK;
+}
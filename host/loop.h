@@ -0,0 +1,24 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#define LOOP_CONNS 64       // virtual connections, numbered from 0
+#define LOOP_LISTENERS 4
+
+/*
+ * Connections are named by the caller.  A connection's output stays
+ * readable after it closes, until the same id connects again.  Every call
+ * runs the server until it is idle before returning.
+ */
+bool loopConnect(int id, int port);
+void loopSend(int id, const char *data, int len);
+void loopClose(int id);
+bool loopOpen(int id);
+const char *loopOutput(int id, int *len);
+void loopDrain(int id);
+void loopAdvance(uint32 ms);
+
+// takes output as it is sent instead of keeping it for loopOutput()
+typedef void LoopSink(int id, const char *data, int len);
+void loopSetSink(LoopSink *sink);
+
+#endif /* LOOP_H */
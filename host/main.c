@@ -0,0 +1,66 @@
+#include <esp8266.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "console.h"
+#include "governor.h"
+#include "host.h"
+#include "ircd.h"
+#include "metrics.h"
+
+/*
+ * The server as a Linux process, for profiling and benchmarking the
+ * protocol engine.  Same start-up as user_init(), with the ports and log
+ * level taken from the command line.  SIGINT and SIGTERM stop the loop,
+ * so a trace is written on the way out.
+ */
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-p port] [-m metrics_port] [-l 0-3] "
+	        "[-t trace.json]\n", argv0);
+	exit(1);
+}
+
+static void
+stop(int sig)
+{
+	hostStop();
+}
+
+int
+main(int argc, char **argv)
+{
+	int port = 6667, metrics_port = METRICS_PORT, opt;
+	const char *trace = NULL;
+
+	while ((opt = getopt(argc, argv, "p:m:l:t:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'm': metrics_port = atoi(optarg); break;
+		case 'l': log_set_level(atoi(optarg)); break;
+		case 't': trace = optarg; break;
+		default:  usage(argv[0]);
+		}
+	}
+	if (trace && !hostTraceTo(trace)) {
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	srandom(time(NULL) ^ getpid());
+	hostNetInit();
+
+	stdout_init();
+	govInit(NULL);
+	ircdInit(port);
+	metricsInit(metrics_port);
+	consoleInit();
+	printf("\nReady on port %d\n> ", port);
+
+	hostRun();
+	return 0;
+}
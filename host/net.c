@@ -0,0 +1,578 @@
+#define _GNU_SOURCE // accept4
+#include <esp8266.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+/*
+ * espconn over nonblocking sockets and epoll.  Like the SDK, a send may
+ * name a connection through the listener with the remote address patched
+ * in, output is copied and owned here until the kernel takes it, and each
+ * espconn_sent() gets its own sent callback once written.  Sends are
+ * written and closes carried out after the callback that made them
+ * returns, never from inside it, and a closed socket is only freed at
+ * the end of the loop pass so no callback is left holding a stale one.
+ */
+
+typedef struct HostSock HostSock;
+struct HostSock {
+	int fd;
+	struct espconn *conn;     // the caller's for a listener, else &own
+	struct espconn own;
+	esp_tcp tcp;
+	HostSock *listener;       // NULL for a listener
+	uint8 max_allow;
+	uint8 clients;
+	char *out;
+	size_t out_len;
+	uint32 written;
+	uint32 queued;
+	uint32 ends[HOST_SENDS];  // queued total at the end of each send
+	uint8 sends;
+	bool held;
+	bool closing;
+	bool dirty;
+	bool dead;
+	HostSock *next;
+};
+
+typedef struct HostNet HostNet;
+struct HostNet {
+	int epfd;
+	HostSock *socks;
+	uint8 max_con;
+	uint8 conns;
+	bool running;
+};
+
+static HostNet net = {
+	.epfd = -1,
+	.max_con = 5,
+};
+
+// marks stdin in the epoll data
+static char hostStdinTag;
+
+uint32
+system_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32
+hostMillis(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+hostNetInit(void)
+{
+	net.epfd = epoll_create1(0);
+	if (net.epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+}
+
+static void
+hostNetWatch(HostSock *sock)
+{
+	struct epoll_event ev;
+
+	ev.events = (sock->held ? 0 : EPOLLIN) | (sock->out_len ? EPOLLOUT : 0);
+	ev.data.ptr = sock;
+	epoll_ctl(net.epfd, EPOLL_CTL_MOD, sock->fd, &ev);
+}
+
+void
+hostNetWatchStdin(void)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &hostStdinTag;
+	epoll_ctl(net.epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+}
+
+/*
+ * A connection's own espconn, or a listener's with the remote address of
+ * one of its connections patched in.
+ */
+static HostSock *
+hostNetFind(struct espconn *conn)
+{
+	HostSock *sock;
+
+	for (sock = net.socks; sock; sock = sock->next) {
+		if (sock->conn == conn && sock->listener && !sock->dead) {
+			return sock;
+		}
+	}
+
+	for (sock = net.socks; sock; sock = sock->next) {
+		if (!sock->listener || sock->listener->conn != conn || sock->dead) {
+			continue;
+		}
+		if (memcmp(sock->tcp.remote_ip, conn->proto.tcp->remote_ip, 4) == 0 &&
+		    sock->tcp.remote_port == conn->proto.tcp->remote_port) {
+			return sock;
+		}
+	}
+	return NULL;
+}
+
+// the SDK reports a peer close through disconcb and errors through reconcb
+static void
+hostNetClose(HostSock *sock, sint8 err)
+{
+	if (sock->dead) {
+		return;
+	}
+
+	sock->dead = true;
+	epoll_ctl(net.epfd, EPOLL_CTL_DEL, sock->fd, NULL);
+	close(sock->fd);
+	sock->listener->clients--;
+	net.conns--;
+
+	if (err == ESPCONN_OK) {
+		if (sock->tcp.disconnect_callback) {
+			sock->tcp.disconnect_callback(sock->conn);
+		}
+	} else if (sock->tcp.reconnect_callback) {
+		sock->tcp.reconnect_callback(sock->conn, err);
+	}
+}
+
+static void
+hostNetAccept(HostSock *listener)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct epoll_event ev;
+	HostSock *sock;
+	int fd, one = 1;
+
+	while ((fd = accept4(listener->fd, (struct sockaddr *)&addr, &len,
+	                     SOCK_NONBLOCK)) >= 0) {
+		if (net.conns >= net.max_con ||
+		    listener->clients >= listener->max_allow) {
+			close(fd);
+			continue;
+		}
+
+		sock = calloc(1, sizeof(*sock));
+		sock->fd = fd;
+		sock->listener = listener;
+		sock->conn = &sock->own;
+		sock->own = *listener->conn;
+		sock->own.proto.tcp = &sock->tcp;
+		sock->own.recv_callback = NULL;
+		sock->own.sent_callback = NULL;
+		sock->tcp = *listener->conn->proto.tcp;
+		memcpy(sock->tcp.remote_ip, &addr.sin_addr.s_addr, 4);
+		sock->tcp.remote_port = ntohs(addr.sin_port);
+		sock->tcp.disconnect_callback = NULL;
+		sock->tcp.reconnect_callback = NULL;
+		sock->next = net.socks;
+		net.socks = sock;
+		listener->clients++;
+		net.conns++;
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		ev.events = EPOLLIN;
+		ev.data.ptr = sock;
+		epoll_ctl(net.epfd, EPOLL_CTL_ADD, fd, &ev);
+
+		if (listener->conn->proto.tcp->connect_callback) {
+			listener->conn->proto.tcp->connect_callback(sock->conn);
+		}
+		len = sizeof(addr);
+	}
+}
+
+static void
+hostNetRead(HostSock *sock)
+{
+	char buf[HOST_MSS];
+	ssize_t n;
+
+	while (!sock->held && !sock->closing && !sock->dead) {
+		n = read(sock->fd, buf, sizeof(buf));
+		if (n == 0) {
+			hostNetClose(sock, ESPCONN_OK);
+			return;
+		}
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				hostNetClose(sock, ESPCONN_RST);
+			}
+			return;
+		}
+
+		if (sock->own.recv_callback) {
+			sock->own.recv_callback(sock->conn, buf, n);
+		}
+		if (n < (ssize_t)sizeof(buf)) {
+			return;
+		}
+	}
+}
+
+// writes what the kernel takes and reports finished sends
+static void
+hostNetWrite(HostSock *sock)
+{
+	ssize_t n;
+	int i, done;
+
+	while (sock->out_len) {
+		n = write(sock->fd, sock->out, sock->out_len);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			hostNetClose(sock, ESPCONN_RST);
+			return;
+		}
+		memmove(sock->out, sock->out + n, sock->out_len - n);
+		sock->out_len -= n;
+		sock->written += n;
+	}
+
+	for (done = 0; done < sock->sends; done++) {
+		if ((sint32)(sock->ends[done] - sock->written) > 0) {
+			break;
+		}
+	}
+	sock->sends -= done;
+	memmove(sock->ends, sock->ends + done, sock->sends * sizeof(uint32));
+
+	if (!sock->out_len && sock->closing) {
+		hostNetClose(sock, ESPCONN_OK);
+		return;
+	}
+	hostNetWatch(sock);
+
+	for (i = 0; i < done && sock->own.sent_callback; i++) {
+		sock->own.sent_callback(sock->conn);
+	}
+}
+
+void
+hostNetPoll(int timeout_ms)
+{
+	struct epoll_event ev[16];
+	HostSock *sock;
+	int i, n;
+
+	n = epoll_wait(net.epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout_ms);
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.ptr == &hostStdinTag) {
+			if (!hostStdinReady()) {
+				epoll_ctl(net.epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+			}
+			continue;
+		}
+
+		sock = ev[i].data.ptr;
+		if (!sock->listener) {
+			hostNetAccept(sock);
+			continue;
+		}
+		if (sock->dead) {
+			continue;
+		}
+		if (ev[i].events & EPOLLOUT) {
+			sock->dirty = true;
+		}
+		if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			hostNetRead(sock);
+		}
+	}
+}
+
+/*
+ * Deferred writes and closes, after the callbacks that asked for them.
+ * Sent callbacks can queue more output, so this goes round until nothing
+ * is left to write, then frees the sockets closed during the pass.
+ */
+void
+hostNetFlush(void)
+{
+	HostSock *sock, **p;
+	bool again = true;
+
+	while (again) {
+		again = false;
+		for (sock = net.socks; sock; sock = sock->next) {
+			if (sock->dirty && !sock->dead) {
+				sock->dirty = false;
+				hostNetWrite(sock);
+				again = true;
+			}
+		}
+	}
+
+	for (p = &net.socks; (sock = *p); ) {
+		if (!sock->dead) {
+			p = &sock->next;
+			continue;
+		}
+		*p = sock->next;
+		free(sock->out);
+		free(sock);
+	}
+}
+
+void
+hostRun(void)
+{
+	net.running = true;
+	while (net.running) {
+		fflush(stdout);
+		hostNetPoll(hostTimerWait());
+		hostTimersRun();
+		hostTasksRun();
+		hostNetFlush();
+	}
+}
+
+void
+hostStop(void)
+{
+	net.running = false;
+}
+
+/* the SDK calls */
+
+sint8
+espconn_accept(struct espconn *conn)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	HostSock *sock;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		return ESPCONN_MEM;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(conn->proto.tcp->local_port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(fd, 16) < 0) {
+		fprintf(stderr, "port %d: %s\n", conn->proto.tcp->local_port,
+		        strerror(errno));
+		close(fd);
+		return ESPCONN_ARG;
+	}
+
+	sock = calloc(1, sizeof(*sock));
+	sock->fd = fd;
+	sock->conn = conn;
+	sock->max_allow = 0xff;
+	sock->next = net.socks;
+	net.socks = sock;
+	conn->state = ESPCONN_LISTEN;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = sock;
+	epoll_ctl(net.epfd, EPOLL_CTL_ADD, fd, &ev);
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_sent(struct espconn *conn, uint8 *data, uint16 len)
+{
+	HostSock *sock = hostNetFind(conn);
+	char *out;
+
+	if (!sock || sock->closing) {
+		return ESPCONN_ARG;
+	}
+	if (sock->out_len + len > HOST_SENDQ) {
+		return ESPCONN_MEM;
+	}
+	if (sock->sends == HOST_SENDS) {
+		return ESPCONN_MAXNUM;
+	}
+
+	out = realloc(sock->out, sock->out_len + len);
+	if (!out) {
+		return ESPCONN_MEM;
+	}
+	sock->out = out;
+	memcpy(sock->out + sock->out_len, data, len);
+	sock->out_len += len;
+	sock->queued += len;
+	sock->ends[sock->sends++] = sock->queued;
+	sock->dirty = true;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_disconnect(struct espconn *conn)
+{
+	HostSock *sock = hostNetFind(conn);
+
+	if (!sock) {
+		return ESPCONN_ARG;
+	}
+
+	sock->closing = true;
+	sock->dirty = true;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_connectcb(struct espconn *conn, espconn_connect_callback cb)
+{
+	conn->proto.tcp->connect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_recvcb(struct espconn *conn, espconn_recv_callback cb)
+{
+	conn->recv_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_sentcb(struct espconn *conn, espconn_sent_callback cb)
+{
+	conn->sent_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_disconcb(struct espconn *conn, espconn_connect_callback cb)
+{
+	conn->proto.tcp->disconnect_callback = cb;
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_regist_reconcb(struct espconn *conn, espconn_reconnect_callback cb)
+{
+	conn->proto.tcp->reconnect_callback = cb;
+	return ESPCONN_OK;
+}
+
+// the server runs its own timeouts; the SDK idle timer is not modelled
+sint8
+espconn_regist_time(struct espconn *conn, uint32 interval, uint8 type_flag)
+{
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_tcp_set_max_con(uint8 num)
+{
+	net.max_con = num;
+	return ESPCONN_OK;
+}
+
+uint8
+espconn_tcp_get_max_con(void)
+{
+	return net.max_con;
+}
+
+sint8
+espconn_tcp_set_max_con_allow(struct espconn *conn, uint8 num)
+{
+	HostSock *sock;
+
+	for (sock = net.socks; sock; sock = sock->next) {
+		if (!sock->listener && sock->conn == conn) {
+			sock->max_allow = num;
+			return ESPCONN_OK;
+		}
+	}
+	return ESPCONN_ARG;
+}
+
+sint8
+espconn_set_opt(struct espconn *conn, uint8 opt)
+{
+	HostSock *sock = hostNetFind(conn);
+	int one = 1;
+
+	if (!sock) {
+		return ESPCONN_ARG;
+	}
+
+	if (opt & ESPCONN_KEEPALIVE) {
+		setsockopt(sock->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	}
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_set_keepalive(struct espconn *conn, uint8 level, void *optarg)
+{
+	HostSock *sock = hostNetFind(conn);
+	int value = *(uint32 *)optarg;
+	int name;
+
+	if (!sock) {
+		return ESPCONN_ARG;
+	}
+
+	switch (level) {
+	case ESPCONN_KEEPIDLE:  name = TCP_KEEPIDLE; break;
+	case ESPCONN_KEEPINTVL: name = TCP_KEEPINTVL; break;
+	case ESPCONN_KEEPCNT:   name = TCP_KEEPCNT; break;
+	default:
+		return ESPCONN_ARG;
+	}
+	setsockopt(sock->fd, IPPROTO_TCP, name, &value, sizeof(value));
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_recv_hold(struct espconn *conn)
+{
+	HostSock *sock = hostNetFind(conn);
+
+	if (!sock) {
+		return ESPCONN_ARG;
+	}
+
+	sock->held = true;
+	hostNetWatch(sock);
+	return ESPCONN_OK;
+}
+
+sint8
+espconn_recv_unhold(struct espconn *conn)
+{
+	HostSock *sock = hostNetFind(conn);
+
+	if (!sock) {
+		return ESPCONN_ARG;
+	}
+
+	sock->held = false;
+	hostNetWatch(sock);
+	return ESPCONN_OK;
+}
@@ -0,0 +1,288 @@
+#include <esp8266.h>
+#include <unistd.h>
+#include "host.h"
+
+/*
+ * The SDK services the server uses, for a Linux process: millisecond
+ * timers, posted tasks, logging to stderr and the console on stdin.  The
+ * clock and the loop that drives all this belong to the transport, net.c
+ * or loop.c.  Everything runs on one thread, so callbacks never overlap,
+ * as on the chip.
+ */
+
+typedef struct HostTask HostTask;
+struct HostTask {
+	os_task_t task;
+	os_event_t queue[HOST_TASK_QUEUE];
+	uint8 head;
+	uint8 len;
+};
+
+typedef struct Host Host;
+struct Host {
+	ETSTimer *timers;
+	HostTask tasks[3];
+	uint8 mhz;
+	int level;
+	uint8 rx_prio;
+	char rx[128];
+	int rx_head;
+	int rx_len;
+};
+
+static Host host = {
+	.mhz = 80,
+	.level = LOG_INFO,
+};
+
+uint32
+system_get_free_heap_size(void)
+{
+	return HOST_HEAP_SIZE;
+}
+
+uint8
+system_get_cpu_freq(void)
+{
+	return host.mhz;
+}
+
+bool
+system_update_cpu_freq(uint8 mhz)
+{
+	host.mhz = mhz;
+	return true;
+}
+
+unsigned long
+os_random(void)
+{
+	return random();
+}
+
+char *
+wifi_station_get_hostname(void)
+{
+	static char name[] = "espircd";
+
+	return name;
+}
+
+/* timers, kept in a list sorted by expiry */
+
+void
+os_timer_disarm(ETSTimer *timer)
+{
+	ETSTimer **p;
+
+	for (p = &host.timers; *p; p = &(*p)->timer_next) {
+		if (*p == timer) {
+			*p = timer->timer_next;
+			break;
+		}
+	}
+	timer->timer_next = NULL;
+}
+
+static void
+hostTimerInsert(ETSTimer *timer)
+{
+	ETSTimer **p;
+
+	for (p = &host.timers; *p; p = &(*p)->timer_next) {
+		if ((sint32)(timer->timer_expire - (*p)->timer_expire) < 0) {
+			break;
+		}
+	}
+	timer->timer_next = *p;
+	*p = timer;
+}
+
+void
+os_timer_arm(ETSTimer *timer, uint32 ms, bool repeat)
+{
+	os_timer_disarm(timer);
+	timer->timer_expire = hostMillis() + ms;
+	timer->timer_period = repeat ? ms : 0;
+	hostTimerInsert(timer);
+}
+
+void
+os_timer_setfn(ETSTimer *timer, ETSTimerFunc *fn, void *arg)
+{
+	timer->timer_func = fn;
+	timer->timer_arg = arg;
+}
+
+// milliseconds until the first timer is due, -1 with none armed
+int
+hostTimerWait(void)
+{
+	sint32 wait;
+
+	if (!host.timers) {
+		return -1;
+	}
+
+	wait = host.timers->timer_expire - hostMillis();
+	return wait > 0 ? wait : 0;
+}
+
+void
+hostTimersRun(void)
+{
+	ETSTimer *timer;
+	uint32 now = hostMillis();
+
+	while ((timer = host.timers) &&
+	       (sint32)(timer->timer_expire - now) <= 0) {
+		host.timers = timer->timer_next;
+		timer->timer_next = NULL;
+		if (timer->timer_period) {
+			timer->timer_expire += timer->timer_period;
+			hostTimerInsert(timer);
+		}
+		timer->timer_func(timer->timer_arg);
+	}
+}
+
+/* tasks */
+
+bool
+system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen)
+{
+	if (prio >= sizeof(host.tasks) / sizeof(host.tasks[0])) {
+		return false;
+	}
+
+	host.tasks[prio].task = task;
+	return true;
+}
+
+bool
+system_os_post(uint8 prio, ETSSignal sig, ETSParam par)
+{
+	HostTask *t;
+	os_event_t *event;
+
+	if (prio >= sizeof(host.tasks) / sizeof(host.tasks[0])) {
+		return false;
+	}
+
+	t = &host.tasks[prio];
+	if (!t->task || t->len == HOST_TASK_QUEUE) {
+		return false;
+	}
+
+	event = &t->queue[(t->head + t->len++) % HOST_TASK_QUEUE];
+	event->sig = sig;
+	event->par = par;
+	return true;
+}
+
+// highest priority first, as the SDK schedules them; true if any ran
+bool
+hostTasksRun(void)
+{
+	HostTask *t;
+	os_event_t event;
+	bool ran = false;
+	int i;
+
+	for (i = sizeof(host.tasks) / sizeof(host.tasks[0]) - 1; i >= 0; i--) {
+		t = &host.tasks[i];
+		while (t->len) {
+			event = t->queue[t->head];
+			t->head = (t->head + 1) % HOST_TASK_QUEUE;
+			t->len--;
+			t->task(&event);
+			ran = true;
+		}
+	}
+	return ran;
+}
+
+/* etslib */
+
+void
+stdout_init(void)
+{
+	setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+void
+stdout_rx_init(uint8 prio)
+{
+	host.rx_prio = prio;
+	hostNetWatchStdin();
+}
+
+// false once stdin is closed; the server keeps running without a console
+bool
+hostStdinReady(void)
+{
+	int n;
+
+	if (host.rx_len) {
+		return true;
+	}
+
+	n = read(STDIN_FILENO, host.rx, sizeof(host.rx));
+	if (n <= 0) {
+		return false;
+	}
+
+	host.rx_head = 0;
+	host.rx_len = n;
+	system_os_post(host.rx_prio, 0, 0);
+	return true;
+}
+
+int
+stdout_getc(void)
+{
+	if (!host.rx_len) {
+		return -1;
+	}
+
+	host.rx_len--;
+	return (unsigned char)host.rx[host.rx_head++];
+}
+
+uint16
+stdout_tx_free(void)
+{
+	return 0xffff;
+}
+
+void
+log_printf(int lvl, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (lvl > host.level) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void
+log_set_level(int lvl)
+{
+	host.level = lvl;
+}
+
+int
+log_get_level(void)
+{
+	return host.level;
+}
+
+uint32
+log_dropped(void)
+{
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include <esp8266.h>
+#include <unistd.h>
+#include "governor.h"
+#include "host.h"
+#include "ircd.h"
+#include "loop.h"
+#include "metrics.h"
+
+/*
+ * Runs a client script against the server over the loopback transport
+ * and prints what every client received.  The clock only moves on wait,
+ * so a script gives the same transcript on every run and a change in the
+ * server shows up as a diff.  Script lines, from stdin:
+ *
+ *   connect <id> [port]
+ *   send <id> <line>       CR LF is appended; \n starts another line
+ *                          in the same packet
+ *   write <id> <text>      the same without the last CR LF
+ *   close <id>
+ *   wait <ms>
+ *
+ * Blank lines and lines starting with # are skipped.  Traces are on the
+ * virtual clock too.
+ */
+
+static bool opened[LOOP_CONNS];
+
+// prints and drains each connection's output, noting closes
+static void
+replayOutput(void)
+{
+	const char *out, *end, *eol;
+	int i, len;
+
+	for (i = 0; i < LOOP_CONNS; i++) {
+		out = loopOutput(i, &len);
+		for (end = out + len; out < end; out = eol + 1) {
+			eol = memchr(out, '\n', end - out);
+			if (!eol) {
+				printf("%d< %.*s\\\n", i, (int)(end - out), out);
+				break;
+			}
+			printf("%d< %.*s\n", i,
+			       (int)(eol - out - (eol > out && eol[-1] == '\r')), out);
+		}
+		loopDrain(i);
+
+		if (opened[i] && !loopOpen(i)) {
+			printf("%d closed\n", i);
+		}
+		opened[i] = loopOpen(i);
+	}
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-l 0-3] [-t trace.json] < script\n", argv0);
+	exit(1);
+}
+
+static int
+replayId(const char *arg, int lineno)
+{
+	int id = arg ? atoi(arg) : -1;
+
+	if (id < 0 || id >= LOOP_CONNS) {
+		fprintf(stderr, "line %d: bad connection id\n", lineno);
+		exit(1);
+	}
+	return id;
+}
+
+int
+main(int argc, char **argv)
+{
+	char line[4096], buf[4096 * 2], *cmd, *arg, *rest, *p, *next;
+	int lineno = 0, id, port, len, opt;
+	const char *trace = NULL;
+	bool eol;
+
+	while ((opt = getopt(argc, argv, "l:t:")) != -1) {
+		switch (opt) {
+		case 'l': log_set_level(atoi(optarg)); break;
+		case 't': trace = optarg; break;
+		default:  usage(argv[0]);
+		}
+	}
+	if (trace && !hostTraceTo(trace)) {
+		return 1;
+	}
+
+	srandom(1);
+
+	govInit(NULL);
+	ircdInit(6667);
+	metricsInit(METRICS_PORT);
+
+	while (fgets(line, sizeof(line), stdin)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		cmd = strtok(line, " ");
+		if (!cmd || cmd[0] == '#') {
+			continue;
+		}
+		arg = strtok(NULL, " ");
+		rest = strtok(NULL, "");
+
+		if (strcmp(cmd, "connect") == 0) {
+			id = replayId(arg, lineno);
+			port = rest ? atoi(rest) : 6667;
+			if (!loopConnect(id, port)) {
+				printf("%d refused\n", id);
+			}
+		} else if (strcmp(cmd, "send") == 0 || strcmp(cmd, "write") == 0) {
+			id = replayId(arg, lineno);
+			len = 0;
+			for (p = rest ? rest : ""; p; p = next) {
+				next = strstr(p, "\\n");
+				if (next) {
+					*next = '\0';
+					next += 2;
+				}
+				eol = next || cmd[0] == 's';
+				printf("%d> %s%s\n", id, p, eol ? "" : "\\");
+				len += snprintf(buf + len, sizeof(buf) - len, "%s%s", p,
+				                eol ? "\r\n" : "");
+			}
+			loopSend(id, buf, len);
+		} else if (strcmp(cmd, "close") == 0) {
+			id = replayId(arg, lineno);
+			printf("%d hangs up\n", id);
+			loopClose(id);
+		} else if (strcmp(cmd, "wait") == 0) {
+			printf("-- %s ms\n", arg ? arg : "0");
+			loopAdvance(arg ? atoi(arg) : 0);
+		} else {
+			fprintf(stderr, "line %d: unknown command %s\n", lineno, cmd);
+			return 1;
+		}
+		replayOutput();
+	}
+	return 0;
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+#
+# Checks a trace written by a host program with -t: it has to be JSON in
+# the Chrome trace event format, with begin/end events in time order.  The
+# ring drops its oldest entries, so an end may have lost its begin.
+
+import json
+import sys
+
+def fail(what):
+	print("%s: %s" % (sys.argv[1], what))
+	sys.exit(1)
+
+with open(sys.argv[1]) as f:
+	try:
+		trace = json.load(f)
+	except ValueError as e:
+		fail("not JSON: %s" % e)
+
+events = trace.get("traceEvents") if isinstance(trace, dict) else None
+if not isinstance(events, list) or not events:
+	fail("no traceEvents")
+
+last = 0
+for i, ev in enumerate(events):
+	if not isinstance(ev.get("name"), str) or ev.get("ph") not in ("B", "E"):
+		fail("event %d: bad name or phase" % i)
+	for key in ("ts", "pid", "tid"):
+		if not isinstance(ev.get(key), int):
+			fail("event %d: no %s" % (i, key))
+	if ev["ts"] < last:
+		fail("event %d: goes back in time" % i)
+	last = ev["ts"]
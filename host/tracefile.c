@@ -0,0 +1,54 @@
+#include <esp8266.h>
+#include "host.h"
+#include "trace.h"
+
+/*
+ * Tracing for the host programs: the ring records from start-up and is
+ * written out as Chrome trace JSON when the process exits, for
+ * chrome://tracing or ui.perfetto.dev.
+ */
+
+#ifdef TRACE_ENABLE
+
+static const char *hostTracePath;
+static FILE *hostTraceOut;
+
+static void
+hostTraceEmit(const char *text)
+{
+	fputs(text, hostTraceOut);
+}
+
+static void
+hostTraceWrite(void)
+{
+	traceStop();
+	hostTraceOut = fopen(hostTracePath, "w");
+	if (!hostTraceOut) {
+		perror(hostTracePath);
+		return;
+	}
+	traceDump(hostTraceEmit);
+	fclose(hostTraceOut);
+}
+
+bool
+hostTraceTo(const char *path)
+{
+	hostTracePath = path;
+	atexit(hostTraceWrite);
+	traceStart();
+	return true;
+}
+
+#else
+
+bool
+hostTraceTo(const char *path)
+{
+	fprintf(stderr, "%s: built without tracing, make with TRACE=1\n",
+	        path);
+	return false;
+}
+
+#endif /* TRACE_ENABLE */
@@ -0,0 +1,228 @@
+#include <esp8266.h>
+#include "console.h"
+#include "governor.h"
+#include "ircd.h"
+#include "trace.h"
+
+/*
+ * Serial admin console.  It needs neither a connection slot nor IRC
+ * registration, so it still works when every slot is taken.  Bytes arrive
+ * through the UART rx ring in etslib and are assembled into lines here.
+ */
+
+typedef struct ConsoleCommand ConsoleCommand;
+struct ConsoleCommand {
+	const char *name;
+	const char *help;
+	void (*handler)(char *args);
+};
+
+static os_event_t consoleQueue[CONSOLE_QUEUE_LEN];
+static char consoleLine[CONSOLE_LINELEN + 1];
+static int consoleLen;
+
+static void ICACHE_FLASH_ATTR consoleHelpCommand(char *args);
+
+static void ICACHE_FLASH_ATTR
+consoleConnsCommand(char *args)
+{
+	ircdPrintConnections();
+}
+
+static void ICACHE_FLASH_ATTR
+consoleKillCommand(char *args)
+{
+	char *reason = strchr(args, ' ');
+
+	if (reason) {
+		*reason++ = 0;
+	}
+
+	if (!args[0]) {
+		printf("usage: kill <nick> [reason]\n");
+		return;
+	}
+
+	if (!ircdKill(args, reason && reason[0] ? reason : "console")) {
+		printf("%s: no such nick\n", args);
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+consoleLoglevelCommand(char *args)
+{
+	int level;
+
+	if (args[0]) {
+		level = atoi(args);
+		if (level < LOG_ERROR || level > LOG_DEBUG) {
+			printf("usage: loglevel [%d-%d]\n", LOG_ERROR, LOG_DEBUG);
+			return;
+		}
+		log_set_level(level);
+	}
+	printf("log level %d\n", log_get_level());
+}
+
+static void ICACHE_FLASH_ATTR
+consoleStatsCommand(char *args)
+{
+	ircdPrintStats();
+	printf("cpu %d MHz, %u clock switches\n", govFreq(),
+	       (unsigned int)govSwitches());
+}
+
+static void ICACHE_FLASH_ATTR
+consoleWallopsCommand(char *args)
+{
+	if (!args[0]) {
+		printf("usage: wallops <text>\n");
+		return;
+	}
+
+	ircdWallops(args);
+}
+
+#ifdef TRACE_ENABLE
+static ETSTimer consoleTraceTimer;
+static uint16 consoleTraceLine;
+
+// the dump is far bigger than the tx ring, so it goes out as room frees up
+static void ICACHE_FLASH_ATTR
+consoleTraceTimerCb(void *arg)
+{
+	char buf[TRACE_LINELEN];
+
+	while (stdout_tx_free() > TRACE_LINELEN + 1) {
+		if (!traceDumpLine(consoleTraceLine, buf, sizeof(buf))) {
+			os_timer_disarm(&consoleTraceTimer);
+			return;
+		}
+		printf("%s", buf);
+		consoleTraceLine++;
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+consoleTraceCommand(char *args)
+{
+	if (strcasecmp(args, "on") == 0) {
+		traceStart();
+		printf("tracing into %d slots\n", TRACE_SLOTS);
+	} else if (strcasecmp(args, "off") == 0) {
+		traceStop();
+		printf("%u events recorded\n", traceCount());
+	} else if (strcasecmp(args, "dump") == 0) {
+		traceStop();
+		consoleTraceLine = 0;
+		os_timer_disarm(&consoleTraceTimer);
+		os_timer_setfn(&consoleTraceTimer, consoleTraceTimerCb, NULL);
+		os_timer_arm(&consoleTraceTimer, 20, 1);
+	} else {
+		printf("usage: trace on|off|dump\n");
+	}
+}
+#endif
+
+static ConsoleCommand consoleCommands[] = {
+	{"conns",    "list connections", consoleConnsCommand   },
+	{"help",     "this text",        consoleHelpCommand    },
+	{"kill",     "<nick> [reason]",  consoleKillCommand    },
+	{"loglevel", "[0-3]",            consoleLoglevelCommand},
+	{"stats",    "server counters",  consoleStatsCommand   },
+#ifdef TRACE_ENABLE
+	{"trace",    "on|off|dump",      consoleTraceCommand   },
+#endif
+	{"wallops",  "<text>",           consoleWallopsCommand },
+	{NULL,       NULL,               NULL                  },
+};
+
+static void ICACHE_FLASH_ATTR
+consoleHelpCommand(char *args)
+{
+	ConsoleCommand *cmd;
+
+	for (cmd = consoleCommands; cmd->name; cmd++) {
+		printf("%-8s %s\n", cmd->name, cmd->help);
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+consoleExecute(char *line)
+{
+	ConsoleCommand *cmd;
+	char *args;
+
+	while (*line == ' ') {
+		line++;
+	}
+	if (!*line) {
+		return;
+	}
+
+	args = strchr(line, ' ');
+	if (args) {
+		*args++ = 0;
+		while (*args == ' ') {
+			args++;
+		}
+	} else {
+		args = line + strlen(line);
+	}
+
+	for (cmd = consoleCommands; cmd->name; cmd++) {
+		if (strcasecmp(cmd->name, line) == 0) {
+			cmd->handler(args);
+			return;
+		}
+	}
+	printf("%s: unknown command, try help\n", line);
+}
+
+static void ICACHE_FLASH_ATTR
+consoleTask(os_event_t *event)
+{
+	int c;
+
+	while ((c = stdout_getc()) >= 0) {
+		if (c == '\r' || c == '\n') {
+			if (c == '\n' && consoleLen < 0) {
+				consoleLen = 0; // second half of \r\n
+				continue;
+			}
+			printf("\n");
+			consoleLine[consoleLen > 0 ? consoleLen : 0] = 0;
+			consoleExecute(consoleLine);
+			consoleLen = (c == '\r') ? -1 : 0;
+			printf("> ");
+			continue;
+		}
+
+		if (consoleLen < 0) {
+			consoleLen = 0;
+		}
+
+		if (c == '\b' || c == 0x7f) {
+			if (consoleLen > 0) {
+				consoleLen--;
+				printf("\b \b");
+			}
+			continue;
+		}
+
+		if (c < ' ' || consoleLen >= CONSOLE_LINELEN) {
+			continue;
+		}
+
+		consoleLine[consoleLen++] = c;
+		printf("%c", c);
+	}
+}
+
+void ICACHE_FLASH_ATTR
+consoleInit(void)
+{
+	system_os_task(consoleTask, CONSOLE_TASK_PRIO, consoleQueue,
+	               CONSOLE_QUEUE_LEN);
+	stdout_rx_init(CONSOLE_TASK_PRIO);
+}
@@ -0,0 +1,10 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#define CONSOLE_TASK_PRIO 1
+#define CONSOLE_QUEUE_LEN 4
+#define CONSOLE_LINELEN 120
+
+void ICACHE_FLASH_ATTR consoleInit(void);
+
+#endif /* CONSOLE_H */
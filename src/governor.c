@@ -0,0 +1,158 @@
+#include <esp8266.h>
+#include "governor.h"
+
+/*
+ * CPU clock governor.  Callback busy time and the number of lines queued
+ * are summed over GOV_WINDOW_MS windows.  A busy window, or a burst of
+ * fan-out inside one, switches to GOV_HIGH_MHZ at once; only
+ * GOV_DOWN_WINDOWS quiet windows in a row switch back.  The sampling timer
+ * runs only at the high clock, so an idle server at the low clock is not
+ * woken up by it.
+ */
+
+typedef struct Governor Governor;
+struct Governor {
+	const GovClock *clock;
+	ETSTimer timer;
+	uint32 window_start;
+	uint32 event_start;
+	uint32 busy_us;
+	uint16 lines;
+	uint8 quiet;
+	uint32 switches;
+};
+
+static Governor gov;
+
+static uint32 ICACHE_FLASH_ATTR
+govSdkTime(void)
+{
+	return system_get_time();
+}
+
+static uint8 ICACHE_FLASH_ATTR
+govSdkGetFreq(void)
+{
+	return system_get_cpu_freq();
+}
+
+static bool ICACHE_FLASH_ATTR
+govSdkSetFreq(uint8 mhz)
+{
+	return system_update_cpu_freq(mhz);
+}
+
+static const GovClock govSdkClock = {
+	govSdkTime,
+	govSdkGetFreq,
+	govSdkSetFreq,
+};
+
+static void ICACHE_FLASH_ATTR
+govSwitch(uint8 mhz)
+{
+	if (!gov.clock->setFreq(mhz)) {
+		return;
+	}
+	gov.switches++;
+	gov.quiet = 0;
+
+	os_timer_disarm(&gov.timer);
+	if (mhz == GOV_HIGH_MHZ) {
+		os_timer_arm(&gov.timer, GOV_WINDOW_MS, 1);
+	}
+	log_printf(LOG_DEBUG, "cpu %d MHz\n", mhz);
+}
+
+static void ICACHE_FLASH_ATTR
+govEvaluate(uint32 now)
+{
+	uint32 elapsed = now - gov.window_start;
+	uint32 pct = elapsed >= 100 ? gov.busy_us / (elapsed / 100) : 0;
+
+	if (gov.clock->getFreq() != GOV_HIGH_MHZ) {
+		if (pct >= GOV_UP_BUSY_PCT || gov.lines >= GOV_UP_LINES) {
+			govSwitch(GOV_HIGH_MHZ);
+		}
+	} else if (pct <= GOV_DOWN_BUSY_PCT && gov.lines <= GOV_DOWN_LINES) {
+		if (++gov.quiet >= GOV_DOWN_WINDOWS) {
+			govSwitch(GOV_LOW_MHZ);
+		}
+	} else {
+		gov.quiet = 0;
+	}
+
+	gov.window_start = now;
+	gov.busy_us = 0;
+	gov.lines = 0;
+}
+
+// an event may have closed the window just before; a sliver of one
+// would count as quiet
+static void ICACHE_FLASH_ATTR
+govTimerCb(void *arg)
+{
+	uint32 now = gov.clock->time();
+
+	if (now - gov.window_start >= GOV_WINDOW_MS * 1000 / 2) {
+		govEvaluate(now);
+	}
+}
+
+void ICACHE_FLASH_ATTR
+govEventEnter(void)
+{
+	if (gov.clock) {
+		gov.event_start = gov.clock->time();
+	}
+}
+
+void ICACHE_FLASH_ATTR
+govEventLeave(uint16 lines)
+{
+	uint32 now;
+
+	if (!gov.clock) {
+		return;
+	}
+
+	now = gov.clock->time();
+	gov.busy_us += now - gov.event_start;
+	gov.lines += lines;
+
+	// don't sit out the rest of the window in a join storm
+	if (now - gov.window_start >= GOV_WINDOW_MS * 1000 ||
+		(gov.clock->getFreq() != GOV_HIGH_MHZ &&
+		 (gov.lines >= GOV_UP_LINES ||
+		  gov.busy_us >= GOV_WINDOW_MS * 10 * GOV_UP_BUSY_PCT))) {
+		govEvaluate(now);
+	}
+}
+
+uint8 ICACHE_FLASH_ATTR
+govFreq(void)
+{
+	return gov.clock ? gov.clock->getFreq() : 0;
+}
+
+uint32 ICACHE_FLASH_ATTR
+govSwitches(void)
+{
+	return gov.switches;
+}
+
+void ICACHE_FLASH_ATTR
+govInit(const GovClock *clock)
+{
+	bzero(&gov, sizeof(gov));
+	gov.clock = clock ? clock : &govSdkClock;
+	gov.window_start = gov.clock->time();
+
+	os_timer_disarm(&gov.timer);
+	os_timer_setfn(&gov.timer, govTimerCb, NULL);
+
+	// start low; the first busy window brings the clock up
+	if (gov.clock->getFreq() != GOV_LOW_MHZ) {
+		gov.clock->setFreq(GOV_LOW_MHZ);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#define GOV_LOW_MHZ 80
+#define GOV_HIGH_MHZ 160
+#define GOV_WINDOW_MS 250
+#define GOV_UP_BUSY_PCT 40    // busy share of a window that steps up
+#define GOV_UP_LINES 24       // lines queued in a window that step up
+#define GOV_DOWN_BUSY_PCT 8   // a window at or below this counts as quiet
+#define GOV_DOWN_LINES 4
+#define GOV_DOWN_WINDOWS 8    // quiet windows in a row before stepping down
+
+typedef struct GovClock GovClock;
+
+/*
+ * Everything the governor needs from the chip.  govInit(NULL) uses the
+ * SDK; a host build passes its own so the policy can be driven against a
+ * fake clock.
+ */
+struct GovClock {
+	uint32 (*time)(void);         // free running microseconds
+	uint8 (*getFreq)(void);       // current MHz
+	bool (*setFreq)(uint8 mhz);
+};
+
+void ICACHE_FLASH_ATTR govInit(const GovClock *clock);
+void ICACHE_FLASH_ATTR govEventEnter(void);
+void ICACHE_FLASH_ATTR govEventLeave(uint16 lines);
+uint8 ICACHE_FLASH_ATTR govFreq(void);
+uint32 ICACHE_FLASH_ATTR govSwitches(void);
+
+#endif /* GOVERNOR_H */
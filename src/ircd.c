@@ -1,23 +1,578 @@
 #include <esp8266.h>
+#include "governor.h"
 #include "ircd.h"
-
-#define DEBUG
+#include "trace.h"
 
 static Ircd ircd;
 
+/*
+ * Connection classes, first match wins.  The class is picked at connect
+ * time from the client address and the port it came in on.
+ */
+static IrcClass ircClasses[] = {
+	// softAP clients: few, quiet, rarely pinged
+	{"sensors", {192, 168, 4, 0}, 24, 0, 2, 0, SENDQ_LINES,
+	 PING_TIME_MAX, PING_TIME_MAX, 4, 1},
+	// scripts on their own port get a deeper queue and a bigger budget
+	{"bots", {0, 0, 0, 0}, 0, 6668, 2, 0, 2 * SENDQ_LINES,
+	 PING_TIME, PING_TIME_MAX, 20, 5},
+	// everyone else, with two slots the others can't take
+	{"users", {0, 0, 0, 0}, 0, 0, MAX_USERS, 2, SENDQ_LINES,
+	 PING_TIME, PING_TIME_MAX, FLOOD_BURST, FLOOD_RATE},
+	{NULL},
+};
+
+// ircd.now in whole seconds, carried over from the microsecond timer
+static void ICACHE_FLASH_ATTR
+ircdClock(void)
+{
+	uint32 t = system_get_time();
+
+	ircd.clock_us += t - ircd.clock_last;
+	ircd.clock_last = t;
+	while (ircd.clock_us >= 1000000) {
+		ircd.clock_us -= 1000000;
+		ircd.now++;
+	}
+}
+
+/*
+ * Every SDK callback is an "event".  Formatting buffers are carved out of
+ * a static scratch arena that is rewound at the start of each event, so a
+ * deep call chain holds a few arena slices instead of several 512 byte
+ * stack frames.
+ */
+static void ICACHE_FLASH_ATTR
+ircdEventEnter(void *frame)
+{
+	ircd.stack_base = frame;
+	ircd.scratch_used = 0;
+	ircd.event_lines = 0;
+	ircdClock();
+	ircd.event_us = ircd.clock_last;
+	ircd.input_us = ircd.event_us;
+	govEventEnter();
+}
+
+static void ICACHE_FLASH_ATTR ircDisconnect(IrcUser *user, const char *cmd,
+	const char *reason_prefix, const char *reason);
+static void ICACHE_FLASH_ATTR ircdHeapCheck(void);
+static void ICACHE_FLASH_ATTR ircUserHoldUpdate(IrcUser *user);
+
+static bool ICACHE_FLASH_ATTR
+ircPoolFull(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_AWAKE; i++) {
+		if (!ircd.rxbuf_owner[i]) {
+			return false;
+		}
+	}
+	for (i = 0; i < FLOOD_HOLD_SLOTS; i++) {
+		if (!ircd.flood[i].user) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Clients that overran their sendq are dropped here rather than in
+ * ircSend, whose callers are usually walking the user table.  What is
+ * still unacknowledged becomes the backlog the next event measures, and
+ * input held for a refused send is let go once nothing is in flight.
+ * With every receive and hold buffer taken, clients without one are held
+ * so an unfinished line has nowhere to be lost from.  Busy time and
+ * fan-out of the event feed the clock governor, and free heap is sampled
+ * for its low-water mark.
+ */
+static void ICACHE_FLASH_ATTR
+ircdEventLeave(void)
+{
+	IrcUser *user;
+	bool full;
+	int i;
+
+	for (i = 0; i < MAX_USERS; i++) {
+		user = &ircd.users[i];
+		if ((user->flags & (USER_FLAG_CONNECTED | USER_FLAG_SENDQ)) ==
+		    (USER_FLAG_CONNECTED | USER_FLAG_SENDQ)) {
+			ircDisconnect(user, "QUIT", NULL, "Max SendQ exceeded");
+		}
+		user->sendq_mark = user->sendq;
+		if ((user->flags & USER_FLAG_BLOCKED) && !user->sendq) {
+			user->flags &= ~USER_FLAG_BLOCKED;
+			ircUserHoldUpdate(user);
+		}
+	}
+
+	full = ircPoolFull();
+	if (full || ircd.pool_full) {
+		ircd.pool_full = full;
+		for (i = 0; i < MAX_USERS; i++) {
+			user = &ircd.users[i];
+			if ((user->flags & (USER_FLAG_CONNECTED | USER_FLAG_DETACHED)) ==
+			    USER_FLAG_CONNECTED && !user->msgbuf) {
+				ircUserHoldUpdate(user);
+			}
+		}
+	}
+	ircdHeapCheck();
+	govEventLeave(ircd.event_lines);
+}
+
+static void ICACHE_FLASH_ATTR
+ircStackCheck(void *frame)
+{
+	size_t depth = (char *)ircd.stack_base - (char *)frame;
+
+	if (ircd.stack_base && depth > ircd.stack_peak) {
+		ircd.stack_peak = depth;
+	}
+}
+
+/*
+ * Log-scaled histograms cheap enough to keep on: adding a sample is a few
+ * shifts, and percentiles are only worked out when STATS asks.
+ */
+static void ICACHE_FLASH_ATTR
+ircHistAdd(IrcHist *hist, uint32 us)
+{
+	int b = 0, i;
+
+	us >>= HIST_SHIFT;
+	while (us && b < HIST_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+
+	if (hist->bucket[b] == 0xffff) {
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			hist->bucket[i] >>= 1;
+		}
+	}
+	hist->bucket[b]++;
+}
+
+// upper bound of the bucket holding the pct'th percentile, 0 if empty,
+// or HIST_OVERFLOW if it lies past the last bounded bucket
+#define HIST_OVERFLOW 0xffffffff
+
+static uint32 ICACHE_FLASH_ATTR
+ircHistPercentile(IrcHist *hist, int pct)
+{
+	uint32 total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += hist->bucket[i];
+	}
+	if (!total) {
+		return 0;
+	}
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += hist->bucket[i];
+		if (seen * 100 >= total * pct) {
+			return 1 << (HIST_SHIFT + i);
+		}
+	}
+	return HIST_OVERFLOW;
+}
+
+// p50/p90/p99 as "a/b/c", an overflow shown as over the last bound
+static void ICACHE_FLASH_ATTR
+ircHistText(char *buf, size_t len, IrcHist *hist)
+{
+	static const int pcts[] = {50, 90, 99};
+	uint32 us;
+	int i, n = 0;
+
+	for (i = 0; i < 3 && n < (int)len; i++) {
+		us = ircHistPercentile(hist, pcts[i]);
+		if (us == HIST_OVERFLOW) {
+			n += snprintf(buf + n, len - n, "%s>%u", i ? "/" : "",
+			              1U << (HIST_SHIFT + HIST_BUCKETS - 2));
+		} else {
+			n += snprintf(buf + n, len - n, "%s%u", i ? "/" : "",
+			              (unsigned int)us);
+		}
+	}
+}
+
+static char * ICACHE_FLASH_ATTR
+ircScratchAlloc(size_t len)
+{
+	char *p;
+
+	len = (len + 3) & ~3;
+	if (ircd.scratch_used + len > SCRATCH_SIZE) {
+		// sized for the deepest call chain; callers skip what needed it
+		log_printf(LOG_ERROR, "scratch arena exhausted\n");
+		ircd.scratch_overflows++;
+		return NULL;
+	}
+
+	p = ircd.scratch + ircd.scratch_used;
+	ircd.scratch_used += len;
+	if (ircd.scratch_used > ircd.scratch_peak) {
+		ircd.scratch_peak = ircd.scratch_used;
+	}
+	return p;
+}
+
+static size_t ICACHE_FLASH_ATTR
+ircScratchMark(void)
+{
+	return ircd.scratch_used;
+}
+
+static void ICACHE_FLASH_ATTR
+ircScratchRelease(size_t mark)
+{
+	ircd.scratch_used = mark;
+}
+
+/*
+ * Rewrite a line for a client with the compact-prefix capability:
+ * ":nick!user@host CMD ..." becomes ":nick CMD ..." and our own server
+ * prefix is dropped entirely, which the client takes to mean us.
+ */
+static void ICACHE_FLASH_ATTR
+ircCompactLine(char *buf, size_t buflen, const char *msg)
+{
+	const char *host = wifi_station_get_hostname();
+	const char *end, *p;
+	size_t len;
+
+	end = strchr(msg, ' ');
+	if (msg[0] != ':' || !end) {
+		snprintf(buf, buflen, "%s\r\n", msg);
+		return;
+	}
+
+	for (p = msg; p < end && *p != '!'; p++) {
+	}
+
+	if (p < end) {
+		len = p - msg;
+		memcpy(buf, msg, len);
+		snprintf(buf + len, buflen - len, "%s\r\n", end);
+		return;
+	}
+
+	len = end - msg - 1;
+	if (len == strlen(host) && strncasecmp(msg + 1, host, len) == 0) {
+		snprintf(buf, buflen, "%s\r\n", end + 1);
+		return;
+	}
+
+	snprintf(buf, buflen, "%s\r\n", msg);
+}
+
+/*
+ * Connection deadlines (registration timeout, keepalive PING and ping
+ * timeout) are kept in a hashed timing wheel of one second buckets, indexed
+ * by absolute deadline.  ircd.timer is a one-shot armed for the earliest
+ * deadline only, and traffic just moves last_recv: a user whose deadline
+ * fires early is simply rescheduled.
+ */
+static void ICACHE_FLASH_ATTR
+ircdTimerArm(uint32 deadline)
+{
+	sint32 ms;
+
+	ms = (sint32)(deadline - ircd.now) * 1000 - ircd.clock_us / 1000 + 1;
+	if (ms < 1) {
+		ms = 1;
+	}
+
+	os_timer_disarm(&ircd.timer);
+	os_timer_arm(&ircd.timer, ms, 0);
+	ircd.timer_deadline = deadline;
+	ircd.timer_armed = true;
+}
+
+static void ICACHE_FLASH_ATTR
+ircdTimerRearm(void)
+{
+	IrcUser *user;
+	uint32 tick, next;
+	bool found;
+	int i;
+
+	for (i = 1; i <= WHEEL_SLOTS; i++) {
+		tick = ircd.wheel_tick + i;
+		user = ircd.wheel[tick & (WHEEL_SLOTS - 1)];
+		for (; user; user = user->timer_next) {
+			if ((sint32)(user->deadline - tick) <= 0) {
+				ircdTimerArm(tick);
+				return;
+			}
+		}
+	}
+
+	// nothing due within one revolution, take the earliest later round
+	next = ircd.now + CLOCK_UPKEEP;
+	found = false;
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		for (user = ircd.wheel[i]; user; user = user->timer_next) {
+			if (!found || (sint32)(user->deadline - next) < 0) {
+				next = user->deadline;
+				found = true;
+			}
+		}
+	}
+	ircdTimerArm(next);
+}
+
+static void ICACHE_FLASH_ATTR
+ircTimerCancel(IrcUser *user)
+{
+	if (!user->timer_pprev) {
+		return;
+	}
+
+	*user->timer_pprev = user->timer_next;
+	if (user->timer_next) {
+		user->timer_next->timer_pprev = user->timer_pprev;
+	}
+	user->timer_next = NULL;
+	user->timer_pprev = NULL;
+}
+
+static void ICACHE_FLASH_ATTR
+ircTimerSchedule(IrcUser *user, uint32 deadline)
+{
+	IrcUser **slot;
+
+	ircTimerCancel(user);
+
+	if ((sint32)(deadline - ircd.wheel_tick) <= 0) {
+		deadline = ircd.wheel_tick + 1;
+	}
+	user->deadline = deadline;
+
+	slot = &ircd.wheel[deadline & (WHEEL_SLOTS - 1)];
+	user->timer_next = *slot;
+	if (*slot) {
+		(*slot)->timer_pprev = &user->timer_next;
+	}
+	*slot = user;
+	user->timer_pprev = slot;
+
+	if (!ircd.timer_busy && (!ircd.timer_armed ||
+		(sint32)(deadline - ircd.timer_deadline) < 0)) {
+		ircdTimerArm(deadline);
+	}
+}
+
+/*
+ * With TCP keepalive on the connection lwIP finds dead peers by itself;
+ * application PINGs are then only sent to clients that asked for them.
+ */
+static bool ICACHE_FLASH_ATTR
+ircWantsPing(IrcUser *user)
+{
+	return !(user->flags & USER_FLAG_KEEPALIVE) || (user->caps & USER_CAP_PING);
+}
+
+/*
+ * Client connections are reached through their listener with the remote
+ * address filled in.
+ */
+static struct espconn * ICACHE_FLASH_ATTR
+ircUserConn(IrcUser *user)
+{
+	struct espconn *conn = &ircd.listen[user->listener].conn;
+
+	memcpy(conn->proto.tcp->remote_ip, user->remote_ip, 4);
+	conn->proto.tcp->remote_port = user->remote_port;
+	return conn;
+}
+
+// msgbuf may also be a scratch line lent by ircUserStarve()
+static void ICACHE_FLASH_ATTR
+ircUserSleep(IrcUser *user)
+{
+	int i;
+
+	if (!user->msgbuf) {
+		return;
+	}
+
+	for (i = 0; i < MAX_AWAKE; i++) {
+		if (ircd.rxbuf_owner[i] == user) {
+			ircd.rxbuf_owner[i] = NULL;
+		}
+	}
+	user->msgbuf = NULL;
+	log_printf(LOG_DEBUG, "u%2d hibernating\n", user->index);
+}
+
+/*
+ * Gives a hibernating client a receive buffer again, if need be by putting
+ * to sleep the longest idle client that has been quiet for HIBERNATE_IDLE
+ * and has no partial line.
+ */
+static bool ICACHE_FLASH_ATTR
+ircUserWake(IrcUser *user)
+{
+	IrcUser *owner, *victim = NULL;
+	int i, slot = -1;
+
+	if (user->msgbuf) {
+		return true;
+	}
+
+	for (i = 0; i < MAX_AWAKE; i++) {
+		owner = ircd.rxbuf_owner[i];
+		if (!owner) {
+			slot = i;
+			break;
+		}
+
+		if (owner->msgbuf[0] || owner->flood ||
+			ircd.now - owner->last_recv < HIBERNATE_IDLE) {
+			continue;
+		}
+		if (!victim || (sint32)(owner->last_recv - victim->last_recv) < 0) {
+			victim = owner;
+			slot = i;
+		}
+	}
+	if (slot < 0) {
+		ircd.alloc_fails++;
+		return false;
+	}
+
+	if (ircd.rxbuf_owner[slot]) {
+		ircUserSleep(ircd.rxbuf_owner[slot]);
+	}
+	ircd.rxbuf_owner[slot] = user;
+	user->msgbuf = ircd.rxbuf[slot];
+	user->msgbuf[0] = 0;
+	return true;
+}
+
 static void ICACHE_FLASH_ATTR
 ircSend(IrcUser *to, const char *msg)
 {
-	char buf[MSGLEN + 3];
+	size_t mark = ircScratchMark();
+	char *buf = ircScratchAlloc(MSGLEN + 3);
+	sint8 ret;
+
+	// 4xx and 5xx numerics count against the command being handled
+	if ((msg[0] == '4' || msg[0] == '5') && msg[1] && msg[2] &&
+		msg[3] == ' ') {
+		ircd.error_replies++;
+	}
+
+	// over its sendq the client is dropped when the event ends
+	if (!buf || (to->flags & USER_FLAG_SENDQ)) {
+		to->drops++;
+		ircScratchRelease(mark);
+		return;
+	}
+
+	ircStackCheck(__builtin_frame_address(0));
+
+	if (to->caps & USER_CAP_COMPACT) {
+		ircCompactLine(buf, MSGLEN + 3, msg);
+	} else {
+		snprintf(buf, MSGLEN + 3, "%s\r\n", msg);
+	}
+	log_printf(LOG_DEBUG, "u%2d << %s\n", to->index, msg);
+
+	if (to->flags & USER_FLAG_DETACHED) {
+		// kept for replay; a session that misses too much is given up
+		if (to->replay->len + strlen(buf) > RESUME_BUFLEN) {
+			to->flags |= USER_FLAG_SENDQ;
+			to->drops++;
+		} else {
+			memcpy(to->replay->buf + to->replay->len, buf, strlen(buf));
+			to->replay->len += strlen(buf);
+		}
+		ircScratchRelease(mark);
+		return;
+	}
+
+	ircd.sent_us = system_get_time();
+	TRACE_BEGIN("send", to->index);
+	ret = espconn_sent(ircUserConn(to), (unsigned char *)buf, strlen(buf));
+	TRACE_END("send", to->index);
+	if (ret == ESPCONN_MAXNUM || ret == ESPCONN_MEM) {
+		// the stack is full for now: the line is lost, and the client's
+		// input waits until what it has queued has gone out
+		to->send_fails++;
+		to->drops++;
+		if (ret == ESPCONN_MEM) {
+			ircd.alloc_fails++;
+		}
+		if (!(to->flags & USER_FLAG_BLOCKED)) {
+			to->flags |= USER_FLAG_BLOCKED;
+			ircUserHoldUpdate(to);
+		}
+	} else if (ret != ESPCONN_OK) {
+		to->flags |= USER_FLAG_SENDQ;
+		to->send_fails++;
+	} else {
+		to->lines_out++;
+		to->bytes_out += strlen(buf);
+		ircd.lines_out++;
+		ircd.bytes_out += strlen(buf);
+		if (++to->sendq > to->sendq_peak) {
+			to->sendq_peak = to->sendq;
+		}
+		// sent callbacks only come after the event, so a burst is fine;
+		// lines left over from earlier ones mean the client lags
+		if (to->sendq_mark > to->cls->sendq) {
+			to->flags |= USER_FLAG_SENDQ;
+		}
+	}
+	ircd.event_lines++;
+
+	ircScratchRelease(mark);
+}
+
+static void ICACHE_FLASH_ATTR
+ircdHeapCheck(void)
+{
+	uint32 heap = system_get_free_heap_size();
+	char *buf;
+	int i;
 
-	snprintf(buf, sizeof(buf), "%s\r\n", msg);
-#ifdef DEBUG
-	printf("u%2d << %s\n", to->index, msg);
-#endif
+	if (heap < ircd.heap_min) {
+		ircd.heap_min = heap;
+	}
+
+	if (ircd.heap_low) {
+		ircd.heap_low = heap < HEAP_ALERT + HEAP_ALERT / 4;
+		return;
+	}
+	if (heap >= HEAP_ALERT) {
+		return;
+	}
+
+	ircd.heap_low = true;
+	log_printf(LOG_WARN, "heap low: %u bytes free\n", (unsigned int)heap);
+	buf = ircScratchAlloc(MSGLEN + 1);
+	if (!buf) {
+		return;
+	}
+	for (i = 0; i < MAX_USERS; i++) {
+		if ((ircd.users[i].flags & (USER_FLAG_CONNECTED | USER_FLAG_OPERATOR))
+		    != (USER_FLAG_CONNECTED | USER_FLAG_OPERATOR)) {
+			continue;
+		}
 
-	memcpy(ircd.conn.proto.tcp->remote_ip, to->remote_ip, 4);
-	ircd.conn.proto.tcp->remote_port = to->remote_port;
-	espconn_sent(&ircd.conn, (unsigned char *)buf, strlen(buf));
+		snprintf(buf, MSGLEN + 1, ":%s NOTICE %s :*** Heap low: %u bytes "
+		         "free, %u allocation failures", wifi_station_get_hostname(),
+		         ircd.users[i].nick, (unsigned int)heap,
+		         (unsigned int)ircd.alloc_fails);
+		ircSend(&ircd.users[i], buf);
+	}
 }
 
 static void ICACHE_FLASH_ATTR
@@ -53,18 +608,146 @@ ircBroadcast(IrcUser *user, const char *msg)
 	}
 }
 
+static bool ICACHE_FLASH_ATTR
+ircMatch(const char *mask, const char *s)
+{
+	const char *star = NULL, *back = NULL;
+
+	while (*s) {
+		if (*mask == '*') {
+			star = ++mask;
+			back = s;
+			continue;
+		}
+
+		if (*mask == '?' || tolower((unsigned char)*mask) ==
+			tolower((unsigned char)*s)) {
+			mask++;
+			s++;
+			continue;
+		}
+
+		if (!star) {
+			return false;
+		}
+
+		mask = star;
+		s = ++back;
+	}
+
+	while (*mask == '*') {
+		mask++;
+	}
+	return !*mask;
+}
+
+static void ICACHE_FLASH_ATTR
+ircUserMask(IrcUser *user, char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "%s!%s@" IPSTR, user->nick, user->user,
+	         IP2STR(&user->remote_ip));
+}
+
+static bool ICACHE_FLASH_ATTR
+ircSilenced(IrcUser *user, const char *mask)
+{
+	int i;
+
+	for (i = 0; i < MAX_SILENCE; i++) {
+		if (user->silence[i][0] && ircMatch(user->silence[i], mask)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static IrcMonitor * ICACHE_FLASH_ATTR
+ircFindMonitor(const char *nick)
+{
+	IrcMonitor *mon;
+	int i;
+
+	for (i = 0; i < MONITOR_SLOTS; i++) {
+		mon = &ircd.monitors[i];
+		if (!mon->watchers) {
+			continue;
+		}
+
+		if (strncasecmp(mon->nick, nick, NICKLEN) != 0) {
+			continue;
+		}
+
+		return mon;
+	}
+	return NULL;
+}
+
+static void ICACHE_FLASH_ATTR
+ircMonitorNotify(IrcUser *user, const char *nick, bool online)
+{
+	IrcMonitor *mon = ircFindMonitor(nick);
+	IrcUser *watcher;
+	char mask[MASKLEN + 1];
+	size_t mark;
+	char *buf;
+	int i;
+
+	if (!mon) {
+		return;
+	}
+
+	mark = ircScratchMark();
+	buf = ircScratchAlloc(NICKLEN + MASKLEN + 8);
+	if (!buf) {
+		return;
+	}
+	ircUserMask(user, mask, sizeof(mask));
+
+	for (i = 0; i < MAX_USERS; i++) {
+		watcher = &ircd.users[i];
+		if (!(mon->watchers & (1 << i))) {
+			continue;
+		}
+
+		if (!(watcher->flags & USER_FLAG_CONNECTED)) {
+			continue;
+		}
+
+		snprintf(buf, NICKLEN + MASKLEN + 8, "%s %s :%s",
+		         online ? "730" : "731", watcher->nick, online ? mask : nick);
+		ircSend(watcher, buf);
+	}
+
+	ircScratchRelease(mark);
+}
+
+static void ICACHE_FLASH_ATTR
+ircMonitorClear(IrcUser *user)
+{
+	int i;
+
+	for (i = 0; i < MONITOR_SLOTS; i++) {
+		ircd.monitors[i].watchers &= ~(1 << user->index);
+	}
+	user->monitors = 0;
+}
+
 static void ICACHE_FLASH_ATTR
 ircDisconnect(IrcUser *user, const char *cmd, const char *reason_prefix,
 			  const char *reason)
 {
 	IrcChan *chan;
-	char buf[MSGLEN + 1];
+	size_t mark = ircScratchMark();
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	int i;
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " %s :%s%s", user->nick,
-	         user->user, IP2STR(&user->remote_ip), cmd,
-	         reason_prefix ? reason_prefix : "", reason ? reason : "");
-	ircBroadcast(user, buf);
+	// the cleanup below must happen even with nothing to say
+	if (buf) {
+		snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " %s :%s%s", user->nick,
+		         user->user, IP2STR(&user->remote_ip), cmd,
+		         reason_prefix ? reason_prefix : "", reason ? reason : "");
+		ircBroadcast(user, buf);
+	}
 
 	for (i = 0; i < MAX_CHANS; i++) {
 		chan = &ircd.chans[i];
@@ -80,17 +763,45 @@ ircDisconnect(IrcUser *user, const char *cmd, const char *reason_prefix,
 		chan->users--;
 	}
 
-	if (user->flags & USER_FLAG_CONNECTED) {
-		snprintf(buf, sizeof(buf), "ERROR :Closing Link: %s[" IPSTR "] "
-		         "(%s%s)", user->nick, IP2STR(&user->remote_ip),
-		         reason_prefix ? reason_prefix : "", reason ? reason : "");
-		ircSend(user, buf);
-		espconn_disconnect(&ircd.conn); // remote_ip/port set by ircSend
+	ircTimerCancel(user);
+	ircMonitorClear(user);
+	if (user->flood) {
+		user->flood->user = NULL;
+		user->flood = NULL;
+	}
+	user->flags &= ~(USER_FLAG_BLOCKED | USER_FLAG_THROTTLED);
+	if (user->replay) {
+		user->replay->user = NULL;
+		user->replay = NULL;
+	}
+	ircUserSleep(user);
+	if (user->flags & USER_FLAG_REGISTERED) {
+		ircMonitorNotify(user, user->nick, false);
+	}
+
+	log_printf(LOG_INFO, "u%2d in %u lines/%u bytes, out %u lines/%u bytes, "
+	           "%u failed, %u dropped, sendq peak %u\n", user->index,
+	           (unsigned int)user->lines_in, (unsigned int)user->bytes_in,
+	           (unsigned int)user->lines_out, (unsigned int)user->bytes_out,
+	           user->send_fails, user->drops, user->sendq_peak);
+
+	if (user->flags & USER_FLAG_DETACHED) {
+		user->flags &= ~(USER_FLAG_CONNECTED | USER_FLAG_DETACHED);
+		log_printf(LOG_INFO, "u%2d session dropped\n", user->index);
+	} else if (user->flags & USER_FLAG_CONNECTED) {
+		if (buf) {
+			snprintf(buf, MSGLEN + 1, "ERROR :Closing Link: %s[" IPSTR "] "
+			         "(%s%s)", user->nick, IP2STR(&user->remote_ip),
+			         reason_prefix ? reason_prefix : "",
+			         reason ? reason : "");
+			ircSend(user, buf);
+		}
+		espconn_disconnect(ircUserConn(user));
 		user->flags &= ~USER_FLAG_CONNECTED;
-#ifdef DEBUG
-		printf("u%2d disconnected\n", user->index);
-#endif
+		log_printf(LOG_INFO, "u%2d disconnected\n", user->index);
 	}
+
+	ircScratchRelease(mark);
 }
 
 static void ICACHE_FLASH_ATTR
@@ -272,35 +983,77 @@ ircGetChanUsers(IrcChan *chan, char *buf, size_t buflen, bool invisible)
 	return !!count;
 }
 
+static void ICACHE_FLASH_ATTR
+ircResumeIssue(IrcUser *user)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
+
+	user->resume_token[0] = os_random();
+	user->resume_token[1] = os_random();
+	snprintf(buf, MSGLEN + 1, ":%s RESUME TOKEN %08x%08x",
+	         wifi_station_get_hostname(), (unsigned int)user->resume_token[0],
+	         (unsigned int)user->resume_token[1]);
+	ircSend(user, buf);
+}
+
 static void ICACHE_FLASH_ATTR
 ircClientWelcome(IrcUser *user)
 {
-	char buf[MSGLEN + 1], mode[19];
+	size_t mark = ircScratchMark();
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char mode[19];
+
+	if (!buf) {
+		return;
+	}
 
-	snprintf(buf, sizeof(buf), ":%s 001 %s :Welcome to the Internet Relay "
+	snprintf(buf, MSGLEN + 1, ":%s 001 %s :Welcome to the Internet Relay "
 	         "Network %s!%s@" IPSTR, wifi_station_get_hostname(), user->nick,
 	         user->nick, user->user, IP2STR(&user->remote_ip));
 	ircSend(user, buf);
 
-	snprintf(buf, sizeof(buf), "002 %s :Your host is %s, running version %s",
+	snprintf(buf, MSGLEN + 1, "002 %s :Your host is %s, running version %s",
 	         user->nick, wifi_station_get_hostname(), ESPIRCDVERSION);
 	ircSend(user, buf);
 
-	snprintf(buf, sizeof(buf), "003 %s :This server was created %s at %s",
-	         user->nick, __DATE__, __TIME__);
+	snprintf(buf, MSGLEN + 1, "003 %s :This server was created %s at %s",
+	         user->nick, BUILD_DATE, BUILD_TIME);
 	ircSend(user, buf);
 
-	snprintf(buf, sizeof(buf), "004 %s :%s %s iow smnt", user->nick,
+	snprintf(buf, MSGLEN + 1, "004 %s :%s %s iow smnt", user->nick,
 	         wifi_station_get_hostname(), ESPIRCDVERSION);
 	ircSend(user, buf);
 
+	snprintf(buf, MSGLEN + 1, "005 %s CHANTYPES=# NICKLEN=%d MAXTARGETS=%d "
+	         "TARGMAX=PRIVMSG:%d,NOTICE:%d SILENCE=%d MONITOR=%d :are "
+	         "supported by this server", user->nick, NICKLEN, MAXTARGETS,
+	         MAXTARGETS, MAXTARGETS, MAX_SILENCE, MAX_MONITOR);
+	ircSend(user, buf);
+
 	user->flags |= USER_FLAG_REGISTERED | USER_FLAG_WALLOPS |
 				   USER_FLAG_INVISIBLE;
 
 	ircUserFlagsToMode(mode, user->flags, user->flags);
-	snprintf(buf, sizeof(buf), ":%s MODE %s :%s", user->nick, user->nick,
+	snprintf(buf, MSGLEN + 1, ":%s MODE %s :%s", user->nick, user->nick,
 	         mode);
 	ircSend(user, buf);
+
+	ircMonitorNotify(user, user->nick, true);
+	if (user->caps & USER_CAP_RESUME) {
+		ircResumeIssue(user);
+	}
+	user->ping_interval = user->cls->ping_time;
+	if (ircWantsPing(user)) {
+		ircTimerSchedule(user, user->last_recv + user->ping_interval);
+	} else {
+		ircTimerSchedule(user, user->last_recv + HIBERNATE_IDLE);
+	}
+
+	ircScratchRelease(mark);
 }
 
 static IrcUser * ICACHE_FLASH_ATTR
@@ -388,7 +1141,8 @@ ircJoinChan(IrcUser *joining, const char *name)
 {
 	IrcChan *chan;
 	IrcUser *user;
-	char buf[MSGLEN + 1];
+	size_t mark;
+	char *buf;
 	int i;
 
 	chan = ircFindChanByName(name);
@@ -404,17 +1158,25 @@ ircJoinChan(IrcUser *joining, const char *name)
 			chan->user_flags[joining->index] |= CHAN_USER_FLAG_CHANOP;
 		}
 	}
+
+	mark = ircScratchMark();
+	buf = ircScratchAlloc(MSGLEN + 1);
+	if (!buf) {
+		return;
+	}
+
 	if (!chan) {
-		snprintf(buf, sizeof(buf), "403 %s %s :No such chan", joining->nick,
+		snprintf(buf, MSGLEN + 1, "403 %s %s :No such chan", joining->nick,
 		         name);
 		ircSend(joining, buf);
+		ircScratchRelease(mark);
 		return;
 	}
 
 	chan->users++;
 	chan->user_flags[joining->index] |= CHAN_USER_FLAG_JOINED;
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " JOIN :#%s", joining->nick,
+	snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " JOIN :#%s", joining->nick,
 	         joining->user, IP2STR(&joining->remote_ip), chan->name);
 	for (i = 0; i < MAX_USERS; i++) {
 		user = &ircd.users[i];
@@ -430,32 +1192,39 @@ ircJoinChan(IrcUser *joining, const char *name)
 	}
 
 	if (chan->topic[0]) {
-		snprintf(buf, sizeof(buf), "332 %s #%s :%s", joining->nick,
+		snprintf(buf, MSGLEN + 1, "332 %s #%s :%s", joining->nick,
 		         chan->name, chan->topic);
 		ircSend(joining, buf);
 
 		// TODO: 333
 	}
 
-	i = snprintf(buf, sizeof(buf), "353 %s = #%s :", joining->nick,
+	i = snprintf(buf, MSGLEN + 1, "353 %s = #%s :", joining->nick,
 	             chan->name);
-	while (ircGetChanUsers(chan, buf + i, sizeof(buf) - i, true)) {
+	while (ircGetChanUsers(chan, buf + i, MSGLEN + 1 - i, true)) {
 		ircSend(joining, buf);
 	}
 
-	snprintf(buf, sizeof(buf), "366 %s #%s :End of NAMES list", joining->nick,
+	snprintf(buf, MSGLEN + 1, "366 %s #%s :End of NAMES list", joining->nick,
 	         chan->name);
 	ircSend(joining, buf);
+
+	ircScratchRelease(mark);
 }
 
 static void ICACHE_FLASH_ATTR
 ircPartChan(IrcUser *leaving, IrcChan *chan, const char *reason)
 {
 	IrcUser *user;
-	char buf[MSGLEN + 1];
+	size_t mark = ircScratchMark();
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	int i, count;
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " PART #%s :%s", leaving->nick,
+	if (!buf) {
+		return;
+	}
+
+	snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " PART #%s :%s", leaving->nick,
 	         leaving->user, IP2STR(&leaving->remote_ip), chan->name,
 	         reason ? reason : "");
 	count = 0;
@@ -473,52 +1242,200 @@ ircPartChan(IrcUser *leaving, IrcChan *chan, const char *reason)
 
 	chan->users--;
 	chan->user_flags[leaving->index] &= ~CHAN_USER_FLAG_JOINED;
+
+	ircScratchRelease(mark);
 }
 
 static void ICACHE_FLASH_ATTR
 ircAwayCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (msg->params < 1 || !msg->param[0][0]) {
 		from->flags &= ~USER_FLAG_AWAY;
-		snprintf(buf, sizeof(buf), "305 %s :You are no longer marked as "
+		snprintf(buf, MSGLEN + 1, "305 %s :You are no longer marked as "
 		         "being away", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
 	from->flags |= USER_FLAG_AWAY;
-	snprintf(buf, sizeof(buf), "306 %s :You have been marked as being away",
+	snprintf(buf, MSGLEN + 1, "306 %s :You have been marked as being away",
 	         from->nick);
 	ircSend(from, buf);
 }
 
+static IrcCap userCaps[] = {
+	{"espircd/compact-prefix", USER_CAP_COMPACT},
+	{"espircd/server-ping",    USER_CAP_PING   },
+	{"espircd/resume",         USER_CAP_RESUME },
+	{NULL,                     0               },
+};
+
+static IrcCap * ICACHE_FLASH_ATTR
+ircFindCap(const char *name, size_t len)
+{
+	IrcCap *cap;
+
+	for (cap = userCaps; cap->name; cap++) {
+		if (strlen(cap->name) == len &&
+			strncasecmp(cap->name, name, len) == 0) {
+			return cap;
+		}
+	}
+	return NULL;
+}
+
+static void ICACHE_FLASH_ATTR
+ircCapCommand(IrcUser *from, IrcMessage *msg)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	const char *nick = from->nick[0] ? from->nick : "*";
+	const char *sub = msg->param[0];
+	const char *p, *name;
+	uint8 set, clear;
+	IrcCap *cap;
+	bool list;
+	int i;
+
+	if (!buf) {
+		return;
+	}
+
+	list = (strcasecmp(sub, "LIST") == 0);
+	if (list || strcasecmp(sub, "LS") == 0) {
+		if (!list && !(from->flags & USER_FLAG_REGISTERED)) {
+			from->flags |= USER_FLAG_CAPNEG;
+		}
+
+		i = snprintf(buf, MSGLEN + 1, ":%s CAP %s %s :",
+		             wifi_station_get_hostname(), nick, list ? "LIST" : "LS");
+		for (cap = userCaps; cap->name; cap++) {
+			if (list && !(from->caps & cap->flag)) {
+				continue;
+			}
+			i += snprintf(buf + i, MSGLEN + 1 - i, "%s%s",
+			              buf[i - 1] == ':' ? "" : " ", cap->name);
+		}
+		ircSend(from, buf);
+		return;
+	}
+
+	if (strcasecmp(sub, "REQ") == 0) {
+		if (!(from->flags & USER_FLAG_REGISTERED)) {
+			from->flags |= USER_FLAG_CAPNEG;
+		}
+
+		set = 0;
+		clear = 0;
+		cap = NULL;
+		p = msg->params > 1 ? msg->param[1] : "";
+		while (*p) {
+			if (*p == ' ') {
+				p++;
+				continue;
+			}
+
+			name = p;
+			while (*p && *p != ' ') {
+				p++;
+			}
+
+			if (*name == '-') {
+				cap = ircFindCap(name + 1, p - name - 1);
+			} else {
+				cap = ircFindCap(name, p - name);
+			}
+			if (!cap) {
+				break;
+			}
+
+			if (*name == '-') {
+				clear |= cap->flag;
+			} else {
+				set |= cap->flag;
+			}
+		}
+
+		// a request is applied all or nothing
+		snprintf(buf, MSGLEN + 1, ":%s CAP %s %s :%s",
+		         wifi_station_get_hostname(), nick, cap ? "ACK" : "NAK",
+		         msg->params > 1 ? msg->param[1] : "");
+		if (cap) {
+			from->caps = (from->caps | set) & ~clear;
+		}
+		ircSend(from, buf);
+
+		if (cap && (from->flags & USER_FLAG_REGISTERED) &&
+			!from->timer_pprev && ircWantsPing(from)) {
+			ircTimerSchedule(from, ircd.now + from->ping_interval);
+		}
+		if (cap && (set & USER_CAP_RESUME) &&
+			(from->flags & USER_FLAG_REGISTERED)) {
+			ircResumeIssue(from);
+		}
+		return;
+	}
+
+	if (strcasecmp(sub, "END") == 0) {
+		if (!(from->flags & USER_FLAG_CAPNEG)) {
+			return;
+		}
+
+		from->flags &= ~USER_FLAG_CAPNEG;
+		if (!(from->flags & USER_FLAG_REGISTERED) && from->nick[0] &&
+			from->user[0]) {
+			ircClientWelcome(from);
+		}
+		return;
+	}
+
+	snprintf(buf, MSGLEN + 1, "410 %s %s :Invalid CAP command", nick, sub);
+	ircSend(from, buf);
+}
+
 static void ICACHE_FLASH_ATTR
 ircInfoCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (msg->params >= 1 &&
 		(strcasecmp(wifi_station_get_hostname(), msg->param[0]) != 0)) {
-		snprintf(buf, sizeof(buf), "402 %s %s :No such server", from->nick,
+		snprintf(buf, MSGLEN + 1, "402 %s %s :No such server", from->nick,
 		         msg->param[0]);
 		ircSend(from, buf);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), "371 %s :%s", from->nick, ESPIRCDVERSION);
+	snprintf(buf, MSGLEN + 1, "371 %s :%s", from->nick, ESPIRCDVERSION);
 	ircSend(from, buf);
 
-	snprintf(buf, sizeof(buf), "371 %s :Compiled on %s at %s", from->nick,
-	         __DATE__, __TIME__);
+	snprintf(buf, MSGLEN + 1, "371 %s :Compiled on %s at %s", from->nick,
+	         BUILD_DATE, BUILD_TIME);
 	ircSend(from, buf);
 
-	snprintf(buf, sizeof(buf), "371 %s :Source code is available at "
+	snprintf(buf, MSGLEN + 1, "371 %s :Source code is available at "
 	         "https://github.com/jkent/espircd", from->nick);
 	ircSend(from, buf);
 
-	snprintf(buf, sizeof(buf), "374 %s :End of INFO list", from->nick);
+	if (from->flags & USER_FLAG_OPERATOR) {
+		snprintf(buf, MSGLEN + 1, "371 %s :Stack high-water %u bytes, "
+		         "scratch %u/%u bytes, %u overflows", from->nick,
+		         (unsigned int)ircd.stack_peak,
+		         (unsigned int)ircd.scratch_peak, SCRATCH_SIZE,
+		         ircd.scratch_overflows);
+		ircSend(from, buf);
+	}
+
+	snprintf(buf, MSGLEN + 1, "374 %s :End of INFO list", from->nick);
 	ircSend(from, buf);
 }
 
@@ -555,19 +1472,58 @@ ircJoinCommand(IrcUser *from, IrcMessage *msg)
 	ircJoinChan(from, name);
 }
 
+static void ICACHE_FLASH_ATTR
+ircLoglevelCommand(IrcUser *from, IrcMessage *msg)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	int level;
+
+	if (!buf) {
+		return;
+	}
+
+	if (!(from->flags & USER_FLAG_OPERATOR)) {
+		snprintf(buf, MSGLEN + 1, "481 %s :Permission Denied- You're not an "
+		         "IRC operator", from->nick);
+		ircSend(from, buf);
+		return;
+	}
+
+	if (msg->params >= 1) {
+		level = atoi(msg->param[0]);
+		if (level < LOG_ERROR || level > LOG_DEBUG) {
+			snprintf(buf, MSGLEN + 1, ":%s NOTICE %s :Log level must be "
+			         "%d-%d", wifi_station_get_hostname(), from->nick,
+			         LOG_ERROR, LOG_DEBUG);
+			ircSend(from, buf);
+			return;
+		}
+		log_set_level(level);
+	}
+
+	snprintf(buf, MSGLEN + 1, ":%s NOTICE %s :Log level %d, %u records "
+	         "dropped", wifi_station_get_hostname(), from->nick,
+	         log_get_level(), (unsigned int)log_dropped());
+	ircSend(from, buf);
+}
+
 static void ICACHE_FLASH_ATTR
 ircLusersCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcUser *user;
 	IrcChan *chan;
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	int i;
 	int users, invisible, operators;
 	int chans;
 	
+	if (!buf) {
+		return;
+	}
+
 	if (msg->params >= 1 &&
 		(strcasecmp(wifi_station_get_hostname(), msg->param[0]) != 0)) {
-		snprintf(buf, sizeof(buf), "402 %s %s :No such server", from->nick,
+		snprintf(buf, MSGLEN + 1, "402 %s %s :No such server", from->nick,
 		         msg->param[0]);
 		ircSend(from, buf);
 		return;
@@ -601,19 +1557,19 @@ ircLusersCommand(IrcUser *from, IrcMessage *msg)
 		}
 	}
 
-	snprintf(buf, sizeof(buf), "251 %s :There are %d users and %d invisible "
+	snprintf(buf, MSGLEN + 1, "251 %s :There are %d users and %d invisible "
 	         "on 1 servers", from->nick, users, invisible);
 	ircSend(from, buf);
 
-	snprintf(buf, sizeof(buf), "252 %s %d :operator(s) online", from->nick,
+	snprintf(buf, MSGLEN + 1, "252 %s %d :operator(s) online", from->nick,
 	         operators);
 	ircSend(from, buf);
 
-	snprintf(buf, sizeof(buf), "254 %s %d :channels formed", from->nick,
+	snprintf(buf, MSGLEN + 1, "254 %s %d :channels formed", from->nick,
 	         chans);
 	ircSend(from, buf);
 
-	snprintf(buf, sizeof(buf), "255 %s :I have %d clients and 0 servers",
+	snprintf(buf, MSGLEN + 1, "255 %s :I have %d clients and 0 servers",
 	         from->nick, users + invisible);
 	ircSend(from, buf);
 }
@@ -621,19 +1577,24 @@ ircLusersCommand(IrcUser *from, IrcMessage *msg)
 static void ICACHE_FLASH_ATTR
 ircModeCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1], mode[19];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char mode[19];
 	char *p;
 	char operator;
 	uint16 state;
 	bool unknown;
 
+	if (!buf) {
+		return;
+	}
+
 	if (msg->param[0][0] == '#') {
 		//ircChanModeCommand(from, buf);
 		return;
 	}
 
 	if (strcasecmp(from->nick, msg->param[0]) != 0) {
-		snprintf(buf, sizeof(buf), "502 %s :Cannot change mode for other "
+		snprintf(buf, MSGLEN + 1, "502 %s :Cannot change mode for other "
 		         "users", from->nick);
 		ircSend(from, buf);
 		return;
@@ -641,7 +1602,7 @@ ircModeCommand(IrcUser *from, IrcMessage *msg)
 
 	if (msg->params < 2) {
 		ircUserFlagsToMode(mode, from->flags, from->flags);
-		snprintf(buf, sizeof(buf), "221 %s %s", from->nick, mode);
+		snprintf(buf, MSGLEN + 1, "221 %s %s", from->nick, mode);
 		ircSend(from, buf);
 		return;
 	}	
@@ -677,70 +1638,202 @@ ircModeCommand(IrcUser *from, IrcMessage *msg)
 			if (operator == '-') {
 				state &= ~USER_FLAG_OPERATOR;
 			}
-			break;
-		default:
-			unknown = true;
-			break;
+			break;
+		default:
+			unknown = true;
+			break;
+		}
+	}
+
+	if (unknown) {
+		snprintf(buf, MSGLEN + 1, "501 %s :Unknown MODE flag", from->nick);
+		ircSend(from, buf);
+	}
+
+	if (state ^ from->flags) {
+		ircUserFlagsToMode(mode, state, state ^ from->flags);
+		snprintf(buf, MSGLEN + 1, ":%s MODE %s :%s", from->nick, from->nick,
+		         mode);
+		ircSend(from, buf);
+		from->flags = state;
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+ircNamesCommand(IrcUser *from, IrcMessage *msg)
+{
+	IrcChan *chan = ircFindChanByName(msg->param[0]);
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	bool joined;
+	int i;
+
+	if (!buf) {
+		return;
+	}
+
+	if (chan) {
+		joined = (chan->user_flags[from->index] & CHAN_USER_FLAG_JOINED);
+
+		i = snprintf(buf, MSGLEN + 1, "353 %s = #%s :", from->nick,
+		             chan->name);
+		while (ircGetChanUsers(chan, buf + i, MSGLEN + 1 - i, joined)) {
+			ircSend(from, buf);
+		}
+
+		snprintf(buf, MSGLEN + 1, "366 %s #%s :End of NAMES list",
+		         from->nick, chan->name);
+		ircSend(from, buf);
+		return;
+	}
+
+	snprintf(buf, MSGLEN + 1, "366 %s %s :End of NAMES list", from->nick,
+	         msg->param[0] ? msg->param[0] : "*");
+	ircSend(from, buf);	
+
+}
+
+static void ICACHE_FLASH_ATTR
+ircMonitorCommand(IrcUser *from, IrcMessage *msg)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char mask[MASKLEN + 1];
+	char op = msg->param[0][0];
+	char *target, *next;
+	IrcMonitor *mon;
+	IrcUser *user;
+	int i, len;
+
+	if (!buf) {
+		return;
+	}
+
+	if (op == 'C' || op == 'c') {
+		ircMonitorClear(from);
+		return;
+	}
+
+	if (op == 'L' || op == 'l' || op == 'S' || op == 's') {
+		len = snprintf(buf, MSGLEN + 1, "732 %s :", from->nick);
+		for (i = 0; i < MONITOR_SLOTS; i++) {
+			mon = &ircd.monitors[i];
+			if (!(mon->watchers & (1 << from->index))) {
+				continue;
+			}
+
+			if (op == 'L' || op == 'l') {
+				len += snprintf(buf + len, MSGLEN + 1 - len, "%s%s",
+				                buf[len - 1] == ':' ? "" : ",", mon->nick);
+				continue;
+			}
+
+			user = ircFindUserByNick(mon->nick);
+			if (user && (user->flags & USER_FLAG_REGISTERED)) {
+				ircUserMask(user, mask, sizeof(mask));
+				snprintf(buf, MSGLEN + 1, "730 %s :%s", from->nick, mask);
+			} else {
+				snprintf(buf, MSGLEN + 1, "731 %s :%s", from->nick,
+				         mon->nick);
+			}
+			ircSend(from, buf);
+		}
+
+		if (op == 'L' || op == 'l') {
+			if (buf[len - 1] != ':') {
+				ircSend(from, buf);
+			}
+			snprintf(buf, MSGLEN + 1, "733 %s :End of MONITOR list",
+			         from->nick);
+			ircSend(from, buf);
 		}
+		return;
 	}
 
-	if (unknown) {
-		snprintf(buf, sizeof(buf), "501 %s :Unknown MODE flag", from->nick);
-		ircSend(from, buf);
+	if (op != '+' && op != '-') {
+		return;
 	}
 
-	if (state ^ from->flags) {
-		ircUserFlagsToMode(mode, state, state ^ from->flags);
-		snprintf(buf, sizeof(buf), ":%s MODE %s :%s", from->nick, from->nick,
-		         mode);
+	if (msg->params < 2 || !msg->param[1][0]) {
+		snprintf(buf, MSGLEN + 1, "461 %s MONITOR :Not enough parameters",
+		         from->nick);
 		ircSend(from, buf);
-		from->flags = state;
+		return;
 	}
-}
 
-static void ICACHE_FLASH_ATTR
-ircNamesCommand(IrcUser *from, IrcMessage *msg)
-{
-	IrcChan *chan = ircFindChanByName(msg->param[0]);
-	char buf[MSGLEN + 1];
-	bool joined;
-	int i;
+	for (target = msg->param[1]; target; target = next) {
+		next = strchr(target, ',');
+		if (next) {
+			*next++ = '\0';
+		}
 
-	if (chan) {
-		joined = (chan->user_flags[from->index] & CHAN_USER_FLAG_JOINED);
+		if (!target[0]) {
+			continue;
+		}
 
-		i = snprintf(buf, sizeof(buf), "353 %s = #%s :", from->nick,
-		             chan->name);
-		while (ircGetChanUsers(chan, buf + i, sizeof(buf) - i, joined)) {
+		mon = ircFindMonitor(target);
+		if (op == '-') {
+			if (mon && (mon->watchers & (1 << from->index))) {
+				mon->watchers &= ~(1 << from->index);
+				from->monitors--;
+			}
+			continue;
+		}
+
+		if (mon && (mon->watchers & (1 << from->index))) {
+			continue;
+		}
+
+		if (!mon) {
+			for (i = 0; i < MONITOR_SLOTS; i++) {
+				if (!ircd.monitors[i].watchers) {
+					mon = &ircd.monitors[i];
+					break;
+				}
+			}
+		}
+
+		if (!mon || from->monitors >= MAX_MONITOR) {
+			snprintf(buf, MSGLEN + 1, "734 %s %d %s :Monitor list is full.",
+			         from->nick, MAX_MONITOR, target);
 			ircSend(from, buf);
+			return;
 		}
 
-		snprintf(buf, sizeof(buf), "366 %s #%s :End of NAMES list",
-		         from->nick, chan->name);
+		if (!mon->watchers) {
+			strncpy(mon->nick, target, NICKLEN);
+			mon->nick[NICKLEN] = '\0';
+		}
+		mon->watchers |= 1 << from->index;
+		from->monitors++;
+
+		user = ircFindUserByNick(target);
+		if (user && (user->flags & USER_FLAG_REGISTERED)) {
+			ircUserMask(user, mask, sizeof(mask));
+			snprintf(buf, MSGLEN + 1, "730 %s :%s", from->nick, mask);
+		} else {
+			snprintf(buf, MSGLEN + 1, "731 %s :%s", from->nick, target);
+		}
 		ircSend(from, buf);
-		return;
 	}
-
-	snprintf(buf, sizeof(buf), "366 %s %s :End of NAMES list", from->nick,
-	         msg->param[0] ? msg->param[0] : "*");
-	ircSend(from, buf);	
-
 }
 
 static void ICACHE_FLASH_ATTR
 ircMotdCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (msg->params >= 1 &&
 		(strcasecmp(wifi_station_get_hostname(), msg->param[0]) != 0)) {
-		snprintf(buf, sizeof(buf), "402 %s %s :No such server", from->nick,
+		snprintf(buf, MSGLEN + 1, "402 %s %s :No such server", from->nick,
 		         msg->param[0]);
 		ircSend(from, buf);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), "422 %s :MOTD File is missing", from->nick);
+	snprintf(buf, MSGLEN + 1, "422 %s :MOTD File is missing", from->nick);
 	ircSend(from, buf);
 }
 
@@ -748,13 +1841,17 @@ static void ICACHE_FLASH_ATTR
 ircNickCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcUser *user;
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	char *p;
 	bool valid = true;
 	char oldnick[NICKLEN + 1];
 
+	if (!buf) {
+		return;
+	}
+
 	if (msg->params < 1) {
-		snprintf(buf, sizeof(buf), "431 %s :No nickname given", from->nick);
+		snprintf(buf, MSGLEN + 1, "431 %s :No nickname given", from->nick);
 		ircSend(from, buf);
 		return;
 	}
@@ -771,7 +1868,7 @@ ircNickCommand(IrcUser *from, IrcMessage *msg)
 		p++;
 	}
 	if (!valid) {
-		snprintf(buf, sizeof(buf), "432 %s %s :Erroneous Nickname: Illegal "
+		snprintf(buf, MSGLEN + 1, "432 %s %s :Erroneous Nickname: Illegal "
 		         "characters", from->nick, msg->param[0]);
 		ircSend(from, buf);
 		return;
@@ -779,7 +1876,7 @@ ircNickCommand(IrcUser *from, IrcMessage *msg)
 
 	user = ircFindUserByNick(msg->param[0]);
 	if (user) {
-		snprintf(buf, sizeof(buf), "433 %s %s :Nickname is already in use.",
+		snprintf(buf, MSGLEN + 1, "433 %s %s :Nickname is already in use.",
 		         from->nick[0] ? from->nick : "*", msg->param[0]);
 		ircSend(from, buf);
 		return;
@@ -789,106 +1886,208 @@ ircNickCommand(IrcUser *from, IrcMessage *msg)
 	strncpy(from->nick, msg->param[0], NICKLEN);
 	from->nick[NICKLEN] = '\0';
 
-	if (!(from->flags & USER_FLAG_REGISTERED) && from->user[0]) {
+	if (!(from->flags & (USER_FLAG_REGISTERED | USER_FLAG_CAPNEG)) &&
+		from->user[0]) {
 		ircClientWelcome(from);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " NICK :%s", oldnick,
+	snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " NICK :%s", oldnick,
 	         from->user, IP2STR(&from->remote_ip), from->nick);
 	ircBroadcast(from, buf);
+
+	if (from->flags & USER_FLAG_REGISTERED) {
+		ircMonitorNotify(from, oldnick, false);
+		ircMonitorNotify(from, from->nick, true);
+	}
+}
+
+static char * ICACHE_FLASH_ATTR
+ircAppend(char *p, const char *end, const char *s)
+{
+	while (*s && p < end) {
+		*p++ = *s++;
+	}
+	*p = '\0';
+	return p;
 }
 
+/*
+ * Shared by PRIVMSG and NOTICE.  The target list is comma separated and
+ * capped at MAXTARGETS.  The prefix is formatted once, each target only
+ * splices its name and the text in behind it, and every recipient gets
+ * the message at most once even if it shares several target channels.
+ */
 static void ICACHE_FLASH_ATTR
-ircNoticeCommand(IrcUser *from, IrcMessage *msg)
+ircRelayMessage(IrcUser *from, IrcMessage *msg, bool notice)
 {
+	const char *cmd = notice ? "NOTICE" : "PRIVMSG";
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char *line = ircScratchAlloc(MSGLEN + 1);
+	char *target, *next, *p;
+	char mask[MASKLEN + 1];
 	IrcChan *chan;
 	IrcUser *user;
-	char buf[MSGLEN + 1];
+	uint32 sent;
+	uint16 lines;
 	bool joined;
-	int i;
+	int hlen, targets, i;
+
+	if (!buf || !line) {
+		return;
+	}
 
 	if (msg->params < 1) {
-		snprintf(buf, sizeof(buf), "411 %s :No recipient given (NOTICE)",
-		         from->nick);
+		snprintf(buf, MSGLEN + 1, "411 %s :No recipient given (%s)",
+		         from->nick, cmd);
 		ircSend(from, buf);
 		return;
 	}
 
 	if (msg->params < 2 || !msg->param[1][0]) {
-		snprintf(buf, sizeof(buf), "412 %s :No text to send", from->nick);
+		snprintf(buf, MSGLEN + 1, "412 %s :No text to send", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
-	chan = ircFindChanByName(msg->param[0]);
-	if (chan) {
-		joined = (chan->user_flags[from->index] & CHAN_USER_FLAG_JOINED);
-		if (!joined && (chan->flags & CHAN_FLAG_NOOUTSIDE)) {
-			return;
+	// all or nothing: a list that is too long is refused before delivery
+	targets = 0;
+	for (p = msg->param[0]; *p; p++) {
+		if (*p != ',' && (p == msg->param[0] || p[-1] == ',')) {
+			targets++;
+		}
+	}
+	if (targets > MAXTARGETS) {
+		snprintf(buf, MSGLEN + 1, "407 %s %s :Too many targets. "
+		         "Message not delivered", from->nick, msg->param[0]);
+		ircSend(from, buf);
+		return;
+	}
+
+	hlen = snprintf(line, MSGLEN + 1, ":%s!%s@" IPSTR " %s ", from->nick,
+	                from->user, IP2STR(&from->remote_ip), cmd);
+	ircUserMask(from, mask, sizeof(mask));
+
+	sent = 0;
+	for (target = msg->param[0]; target; target = next) {
+		next = strchr(target, ',');
+		if (next) {
+			*next++ = '\0';
 		}
 
-		snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " NOTICE %s :%s",
-		         from->nick, from->user, IP2STR(&from->remote_ip),
-		         msg->param[0], msg->param[1]);
-		for (i = 0; i < MAX_USERS; i++) {
-			user = &ircd.users[i];
-			if (!(user->flags & USER_FLAG_CONNECTED)) {
-				continue;
-			}
+		if (!target[0]) {
+			continue;
+		}
 
-			if (!(chan->user_flags[i] & CHAN_USER_FLAG_JOINED)) {
+		p = ircAppend(line + hlen, line + MSGLEN, target);
+		p = ircAppend(p, line + MSGLEN, " :");
+		ircAppend(p, line + MSGLEN, msg->param[1]);
+
+		chan = ircFindChanByName(target);
+		if (chan) {
+			joined = (chan->user_flags[from->index] & CHAN_USER_FLAG_JOINED);
+			if (!joined && (chan->flags & CHAN_FLAG_NOOUTSIDE)) {
+				if (!notice) {
+					snprintf(buf, MSGLEN + 1, "404 %s #%s :No external "
+					         "channel messages (#%s)", from->nick, chan->name,
+					         chan->name);
+					ircSend(from, buf);
+				}
 				continue;
 			}
 
-			if (user == from) {
-				continue;
+			lines = ircd.event_lines;
+			TRACE_BEGIN("fanout", chan - ircd.chans);
+			for (i = 0; i < MAX_USERS; i++) {
+				user = &ircd.users[i];
+				if (!(user->flags & USER_FLAG_CONNECTED)) {
+					continue;
+				}
+
+				if (!(chan->user_flags[i] & CHAN_USER_FLAG_JOINED)) {
+					continue;
+				}
+
+				if (user == from || (sent & (1 << i))) {
+					continue;
+				}
+
+				sent |= 1 << i;
+				if (ircSilenced(user, mask)) {
+					continue;
+				}
+
+				ircSend(user, line);
 			}
+			TRACE_END("fanout", chan - ircd.chans);
+			if (ircd.event_lines != lines) {
+				ircHistAdd(&ircd.fanout, ircd.sent_us - ircd.event_us);
+			}
+			continue;
+		}
 
-			ircSend(&ircd.users[i], buf);
+		user = ircFindUserByNick(target);
+		if (!user) {
+			snprintf(buf, MSGLEN + 1, "401 %s %s :No such nick/channel",
+			         from->nick, target);
+			ircSend(from, buf);
+			continue;
 		}
-		return;
-	}
 
-	user = ircFindUserByNick(msg->param[0]);
-	if (!user) {
-		snprintf(buf, sizeof(buf), "401 %s %s :No such nick/channel",
-		         from->nick, msg->param[0]);
-		ircSend(from, buf);
-		return;
+		if (!notice && (user->flags & USER_FLAG_AWAY)) {
+			snprintf(buf, MSGLEN + 1, "301 %s %s :User is currently away",
+			         from->nick, user->nick);
+			ircSend(from, buf);
+		}
+
+		if (sent & (1 << user->index)) {
+			continue;
+		}
+
+		sent |= 1 << user->index;
+		if (ircSilenced(user, mask)) {
+			continue;
+		}
+
+		ircSend(user, line);
 	}
+}
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " NOTICE %s :%s", from->nick,
-	         from->user, IP2STR(&from->remote_ip), msg->param[0],
-	         msg->param[1]);
-	ircSend(user, buf);
+static void ICACHE_FLASH_ATTR
+ircNoticeCommand(IrcUser *from, IrcMessage *msg)
+{
+	ircRelayMessage(from, msg, true);
 }
 
 static void ICACHE_FLASH_ATTR
 ircOperCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (strcmp(msg->param[0], OPER_NAME) != 0) {
-		snprintf(buf, sizeof(buf), "491 %s :No O-lines for your host",
+		snprintf(buf, MSGLEN + 1, "491 %s :No O-lines for your host",
 		         from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
 	if (strcmp(msg->param[1], OPER_PASSWORD) != 0) {
-		snprintf(buf, sizeof(buf), "464 %s :Password incorrect", from->nick);
+		snprintf(buf, MSGLEN + 1, "464 %s :Password incorrect", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
 	if (!(from->flags & USER_FLAG_OPERATOR)) {
 		from->flags |= USER_FLAG_OPERATOR;
-		snprintf(buf, sizeof(buf), ":%s MODE %s :+o", from->nick, from->nick);
+		snprintf(buf, MSGLEN + 1, ":%s MODE %s :+o", from->nick, from->nick);
 		ircSend(from, buf);
 	}
 
-	snprintf(buf, sizeof(buf), "381 %s :You are now an IRC Operator",
+	snprintf(buf, MSGLEN + 1, "381 %s :You are now an IRC Operator",
 	         from->nick);
 	ircSend(from, buf);
 }
@@ -897,19 +2096,23 @@ static void ICACHE_FLASH_ATTR
 ircPartCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcChan *chan;
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	char *reason = NULL;
 
+	if (!buf) {
+		return;
+	}
+
 	chan = ircFindChanByName(msg->param[0]);
 	if (!chan) {
-		snprintf(buf, sizeof(buf), "403 %s %s :No such channel", from->nick,
+		snprintf(buf, MSGLEN + 1, "403 %s %s :No such channel", from->nick,
 		         msg->param[0]);
 		ircSend(from, buf);
 		return;
 	}
 
 	if (!(chan->user_flags[from->index] & CHAN_USER_FLAG_JOINED)) {
-		snprintf(buf, sizeof(buf), "442 %s #%s :You're not on that channel",
+		snprintf(buf, MSGLEN + 1, "442 %s #%s :You're not on that channel",
 		         from->nick, chan->name);
 		ircSend(from, buf);
 		return;
@@ -925,15 +2128,19 @@ ircPartCommand(IrcUser *from, IrcMessage *msg)
 static void ICACHE_FLASH_ATTR
 ircPingCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (msg->params < 1) {
-		snprintf(buf, sizeof(buf), "409 %s :No origin specified", from->nick);
+		snprintf(buf, MSGLEN + 1, "409 %s :No origin specified", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), "PONG %s :%s", wifi_station_get_hostname(),
+	snprintf(buf, MSGLEN + 1, "PONG %s :%s", wifi_station_get_hostname(),
 	         msg->param[0]);
 	ircSend(from, buf);
 }
@@ -941,99 +2148,319 @@ ircPingCommand(IrcUser *from, IrcMessage *msg)
 static void ICACHE_FLASH_ATTR
 ircPongCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	uint32 rtt, delta;
+
+	if (!buf) {
+		return;
+	}
 
 	if (msg->params < 1) {
-		snprintf(buf, sizeof(buf), "409 %s :No origin specified", from->nick);
+		snprintf(buf, MSGLEN + 1, "409 %s :No origin specified", from->nick);
 		ircSend(from, buf);
 		return;
 	}
+
+	// our keepalive token is the send time; anything else is unsolicited
+	snprintf(buf, MSGLEN + 1, "%x", (unsigned int)from->ping_sent);
+	if (!from->ping_sent ||
+		strcmp(buf, msg->param[msg->params - 1]) != 0) {
+		return;
+	}
+
+	rtt = (system_get_time() - from->ping_sent) / 1000;
+	rtt = rtt < 1 ? 1 : (rtt > 60000 ? 60000 : rtt);
+	from->ping_sent = 0;
+
+	// RFC 6298 smoothing, in milliseconds
+	if (!from->srtt) {
+		from->srtt = rtt;
+		from->rttvar = rtt / 2;
+	} else {
+		delta = rtt > from->srtt ? rtt - from->srtt : from->srtt - rtt;
+		from->rttvar = (3 * from->rttvar + delta) / 4;
+		from->srtt = (7 * from->srtt + rtt) / 8;
+	}
+
+	from->ping_interval *= 2;
+	if (from->ping_interval > from->cls->ping_time_max) {
+		from->ping_interval = from->cls->ping_time_max;
+	}
+	if (from->ping_interval > PING_TIME_MAX) {
+		from->ping_interval = PING_TIME_MAX;
+	}
 }
 
 static void ICACHE_FLASH_ATTR
 ircPrivmsgCommand(IrcUser *from, IrcMessage *msg)
 {
-	IrcChan *chan;
-	IrcUser *user;
-	char buf[MSGLEN + 1];
-	bool joined;
+	ircRelayMessage(from, msg, false);
+}
+
+static void ICACHE_FLASH_ATTR
+ircQuitCommand(IrcUser *from, IrcMessage *msg)
+{
+	char *reason = from->nick;
+
+	if (msg->params >= 1) {
+		reason = msg->param[0];
+	}
+
+	ircDisconnect(from, "QUIT", "Quit: ", reason);
+}
+
+/*
+ * Reattaches a detached session to this connection.  The new slot is
+ * freed without a QUIT; anything the client sent after RESUME in the same
+ * packet is dropped, so it should wait for RESUME SUCCESS.
+ */
+static void ICACHE_FLASH_ATTR
+ircResumeCommand(IrcUser *from, IrcMessage *msg)
+{
+	IrcUser *user = NULL;
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	int i;
 
-	if (msg->params < 1) {
-		snprintf(buf, sizeof(buf), "411 %s :No recipient given (PRIVMSG)",
-		         from->nick);
-		ircSend(from, buf);
+	if (!buf) {
 		return;
 	}
 
-	if (msg->params < 2 || !msg->param[1][0]) {
-		snprintf(buf, sizeof(buf), "412 %s :No text to send", from->nick);
+	if (from->flags & USER_FLAG_REGISTERED) {
+		snprintf(buf, MSGLEN + 1, ":%s FAIL RESUME REGISTRATION_IS_COMPLETED "
+		         ":Cannot resume after registration",
+		         wifi_station_get_hostname());
 		ircSend(from, buf);
 		return;
 	}
 
-	chan = ircFindChanByName(msg->param[0]);
-	if (chan) {
-		joined = (chan->user_flags[from->index] & CHAN_USER_FLAG_JOINED);
-		if (!joined && (chan->flags & CHAN_FLAG_NOOUTSIDE)) {
-			snprintf(buf, sizeof(buf), "404 %s #%s :No external channel "
-			         "messages (#%s)", from->nick, chan->name, chan->name);
-			ircSend(from, buf);
-			return;
+	for (i = 0; i < MAX_USERS; i++) {
+		if (!(ircd.users[i].flags & USER_FLAG_DETACHED)) {
+			continue;
 		}
 
-		snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " PRIVMSG %s :%s",
-		         from->nick, from->user, IP2STR(&from->remote_ip),
-		         msg->param[0], msg->param[1]);
-		for (i = 0; i < MAX_USERS; i++) {
+		snprintf(buf, MSGLEN + 1, "%08x%08x",
+		         (unsigned int)ircd.users[i].resume_token[0],
+		         (unsigned int)ircd.users[i].resume_token[1]);
+		if (strcasecmp(buf, msg->param[0]) == 0) {
 			user = &ircd.users[i];
-			if (!(user->flags & USER_FLAG_CONNECTED)) {
-				continue;
-			}
+			break;
+		}
+	}
 
-			if (!(chan->user_flags[i] & CHAN_USER_FLAG_JOINED)) {
+	if (!user) {
+		snprintf(buf, MSGLEN + 1, ":%s FAIL RESUME INVALID_TOKEN :Cannot "
+		         "resume connection, token is not valid",
+		         wifi_station_get_hostname());
+		ircSend(from, buf);
+		return;
+	}
+
+	memcpy(user->remote_ip, from->remote_ip, 4);
+	user->remote_port = from->remote_port;
+	user->listener = from->listener;
+	user->sendq = from->sendq;
+	user->sendq_mark = from->sendq_mark;
+	user->flags = (user->flags & ~(USER_FLAG_DETACHED | USER_FLAG_KEEPALIVE)) |
+	              (from->flags & (USER_FLAG_KEEPALIVE | USER_FLAG_BLOCKED |
+	                              USER_FLAG_THROTTLED));
+	user->last_recv = ircd.now;
+	user->sent_ping = false;
+
+	ircTimerCancel(from);
+	if (from->flood) {
+		from->flood->user = NULL;
+		from->flood = NULL;
+	}
+	ircUserSleep(from);
+	from->flags = 0;
+
+	log_printf(LOG_INFO, "u%2d resumed from u%2d\n", user->index,
+	           from->index);
+	snprintf(buf, MSGLEN + 1, ":%s RESUME SUCCESS %s",
+	         wifi_station_get_hostname(), user->nick);
+	ircSend(user, buf);
+
+	if (user->replay->len &&
+		espconn_sent(ircUserConn(user), (unsigned char *)user->replay->buf,
+		             user->replay->len) == ESPCONN_OK) {
+		user->sendq++;
+		user->bytes_out += user->replay->len;
+		ircd.bytes_out += user->replay->len;
+	}
+	user->replay->user = NULL;
+	user->replay = NULL;
+
+	ircResumeIssue(user);
+	if (ircWantsPing(user)) {
+		ircTimerSchedule(user, user->last_recv + user->ping_interval);
+	} else {
+		ircTimerSchedule(user, user->last_recv + HIBERNATE_IDLE);
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+ircSilenceCommand(IrcUser *from, IrcMessage *msg)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char mask[MASKLEN + 1];
+	char *p = msg->params >= 1 ? msg->param[0] : "";
+	char op = '+';
+	int i, slot;
+
+	if (!buf) {
+		return;
+	}
+
+	if (!*p) {
+		for (i = 0; i < MAX_SILENCE; i++) {
+			if (!from->silence[i][0]) {
 				continue;
 			}
 
-			if (user == from) {
-				continue;
+			snprintf(buf, MSGLEN + 1, "271 %s %s %s", from->nick, from->nick,
+			         from->silence[i]);
+			ircSend(from, buf);
+		}
+		snprintf(buf, MSGLEN + 1, "272 %s :End of Silence List", from->nick);
+		ircSend(from, buf);
+		return;
+	}
+
+	if (*p == '+' || *p == '-') {
+		op = *p++;
+	}
+
+	// complete a bare nick or user@host into a full mask
+	if (strchr(p, '!')) {
+		snprintf(mask, sizeof(mask), "%s", p);
+	} else if (strchr(p, '@')) {
+		snprintf(mask, sizeof(mask), "*!%s", p);
+	} else {
+		snprintf(mask, sizeof(mask), "%s!*@*", p);
+	}
+
+	slot = -1;
+	for (i = 0; i < MAX_SILENCE; i++) {
+		if (!from->silence[i][0]) {
+			if (slot < 0) {
+				slot = i;
 			}
+			continue;
+		}
 
-			ircSend(user, buf);
+		if (strcasecmp(from->silence[i], mask) == 0) {
+			break;
+		}
+	}
+
+	if (op == '-') {
+		if (i == MAX_SILENCE) {
+			return;
+		}
+		from->silence[i][0] = '\0';
+	} else {
+		if (i < MAX_SILENCE) {
+			return;
+		}
+
+		if (slot < 0) {
+			snprintf(buf, MSGLEN + 1, "511 %s %s :Your silence list is full",
+			         from->nick, mask);
+			ircSend(from, buf);
+			return;
 		}
+		strcpy(from->silence[slot], mask);
+	}
+
+	snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " SILENCE %c%s", from->nick,
+	         from->user, IP2STR(&from->remote_ip), op, mask);
+	ircSend(from, buf);
+}
+
+static void ICACHE_FLASH_ATTR ircStatsCommands(IrcUser *from, bool reset);
+
+static void ICACHE_FLASH_ATTR
+ircStatsCommand(IrcUser *from, IrcMessage *msg)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char query = msg->params >= 1 ? msg->param[0][0] : '*';
+	IrcUser *user;
+	IrcClass *cls;
+	int i;
+
+	if (!buf) {
 		return;
 	}
 
-	user = ircFindUserByNick(msg->param[0]);
-	if (!user) {
-		snprintf(buf, sizeof(buf), "401 %s %s :No such nick/channel",
-		         from->nick, msg->param[0]);
+	if (!(from->flags & USER_FLAG_OPERATOR)) {
+		snprintf(buf, MSGLEN + 1, "481 %s :Permission Denied- You're not an "
+		         "IRC operator", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
-	if (user->flags & USER_FLAG_AWAY) {
-		snprintf(buf, sizeof(buf), "301 %s %s :User is currently away",
-		         from->nick, user->nick);
-		ircSend(from, buf);
-	}
+	switch (query) {
+	case 'l':
+	case 'L':
+		for (i = 0; i < MAX_USERS; i++) {
+			user = &ircd.users[i];
+			if (!(user->flags & USER_FLAG_CONNECTED)) {
+				continue;
+			}
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " PRIVMSG %s :%s", from->nick,
-	         from->user, IP2STR(&from->remote_ip), msg->param[0],
-	         msg->param[1]);
-	ircSend(user, buf);
-}
+			snprintf(buf, MSGLEN + 1, "211 %s %s[" IPSTR "] %u %u %u %u %u "
+			         "%d :rtt %u ms (var %u), keepalive %s %u s, class %s, "
+			         "sendq peak %u, %u failed, %u dropped",
+			         from->nick, user->nick[0] ? user->nick : "*",
+			         IP2STR(&user->remote_ip), user->sendq,
+			         (unsigned int)user->lines_out,
+			         (unsigned int)(user->bytes_out / 1024),
+			         (unsigned int)user->lines_in,
+			         (unsigned int)(user->bytes_in / 1024),
+			         (int)(ircd.now - user->connect_time), user->srtt,
+			         user->rttvar, ircWantsPing(user) ? "ping" : "tcp",
+			         ircWantsPing(user) ? user->ping_interval : TCP_KEEPIDLE,
+			         user->cls->name, user->sendq_peak, user->send_fails,
+			         user->drops);
+			ircSend(from, buf);
+		}
+		break;
 
-static void ICACHE_FLASH_ATTR
-ircQuitCommand(IrcUser *from, IrcMessage *msg)
-{
-	char *reason = from->nick;
+	case 'm':
+	case 'M':
+		ircStatsCommands(from, msg->params >= 2 &&
+		                 strcasecmp(msg->param[1], "RESET") == 0);
+		break;
 
-	if (msg->params >= 1) {
-		reason = msg->param[0];
+	case 'z':
+	case 'Z':
+		snprintf(buf, MSGLEN + 1, "249 %s :heap %u free, %u min, %u "
+		         "allocation failures, scratch peak %u (%u overflows), "
+		         "stack peak %u", from->nick,
+		         (unsigned int)system_get_free_heap_size(),
+		         (unsigned int)ircd.heap_min, (unsigned int)ircd.alloc_fails,
+		         (unsigned int)ircd.scratch_peak,
+		         (unsigned int)ircd.scratch_overflows,
+		         (unsigned int)ircd.stack_peak);
+		ircSend(from, buf);
+		break;
+
+	case 'y':
+	case 'Y':
+		for (cls = ircClasses; cls->name; cls++) {
+			// class, ping and connect frequency, max links, sendq
+			snprintf(buf, MSGLEN + 1, "218 %s Y %s %u 0 %u %u :port %u, "
+			         "%u reserved, flood %u + %u/s", from->nick, cls->name,
+			         cls->ping_time, cls->max_conns, cls->sendq, cls->port,
+			         cls->reserved, cls->flood_burst, cls->flood_rate);
+			ircSend(from, buf);
+		}
+		break;
 	}
 
-	ircDisconnect(from, "QUIT", "Quit: ", reason);
+	snprintf(buf, MSGLEN + 1, "219 %s %c :End of STATS report", from->nick,
+	         query);
+	ircSend(from, buf);
 }
 
 static void ICACHE_FLASH_ATTR
@@ -1041,13 +2468,17 @@ ircTopicCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcUser *user;
 	IrcChan *chan = ircFindChanByName(msg->param[0]);
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	bool joined;
 	bool privileged;
 	int i;
 
+	if (!buf) {
+		return;
+	}
+
 	if (!chan) {
-		snprintf(buf, sizeof(buf), "403 %s %s :No such channel", from->nick,
+		snprintf(buf, MSGLEN + 1, "403 %s %s :No such channel", from->nick,
 		         msg->param[0]);
 		ircSend(from, buf);
 		return;
@@ -1057,20 +2488,20 @@ ircTopicCommand(IrcUser *from, IrcMessage *msg)
 
 	if (msg->params < 2) {
 		if (!joined && (chan->flags & CHAN_FLAG_SECRET)) {
-			snprintf(buf, sizeof(buf), "442 %s #%s :You're not on that "
+			snprintf(buf, MSGLEN + 1, "442 %s #%s :You're not on that "
 			         "channel", from->nick, chan->name);
 			ircSend(from, buf);
 			return;
 		}
 
 		if (!chan->topic[0]) {
-			snprintf(buf, sizeof(buf), "331 %s #%s :No topic is set.",
+			snprintf(buf, MSGLEN + 1, "331 %s #%s :No topic is set.",
 			         from->nick, chan->name);
 			ircSend(from, buf);
 			return;
 		}
 		
-		snprintf(buf, sizeof(buf), "332 %s #%s :%s", from->nick, chan->name,
+		snprintf(buf, MSGLEN + 1, "332 %s #%s :%s", from->nick, chan->name,
 		         chan->topic);
 		ircSend(from, buf);
 		
@@ -1080,7 +2511,7 @@ ircTopicCommand(IrcUser *from, IrcMessage *msg)
 	}
 
 	if (!joined) {
-		snprintf(buf, sizeof(buf), "442 %s #%s :You're not on that channel",
+		snprintf(buf, MSGLEN + 1, "442 %s #%s :You're not on that channel",
 		         from->nick, chan->name);
 		ircSend(from, buf);
 		return;
@@ -1090,7 +2521,7 @@ ircTopicCommand(IrcUser *from, IrcMessage *msg)
 				 (from->flags & USER_FLAG_OPERATOR);
 
 	if (!privileged && (chan->flags & CHAN_FLAG_TOPICLOCK)) {
-		snprintf(buf, sizeof(buf), "482 %s #%s :You're not channel operator",
+		snprintf(buf, MSGLEN + 1, "482 %s #%s :You're not channel operator",
 		         from->nick, chan->name);
 		ircSend(from, buf);
 		return;
@@ -1099,7 +2530,7 @@ ircTopicCommand(IrcUser *from, IrcMessage *msg)
 	strncpy(chan->topic, msg->param[1], TOPICLEN);
 	chan->topic[TOPICLEN] = '\0';
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " TOPIC #%s :%s", from->nick,
+	snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " TOPIC #%s :%s", from->nick,
 	         from->user, IP2STR(&from->remote_ip), chan->name, chan->topic);
 	for (i = 0; i < MAX_USERS; i++) {
 		user = &ircd.users[i];
@@ -1118,10 +2549,14 @@ ircTopicCommand(IrcUser *from, IrcMessage *msg)
 static void ICACHE_FLASH_ATTR
 ircUserCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (from->flags & USER_FLAG_REGISTERED) {
-		snprintf(buf, sizeof(buf), "462 %s :You may not reregister",
+		snprintf(buf, MSGLEN + 1, "462 %s :You may not reregister",
 		         from->nick);
 		ircSend(from, buf);
 		return;
@@ -1133,7 +2568,8 @@ ircUserCommand(IrcUser *from, IrcMessage *msg)
 	strncpy(from->real, msg->param[3], REALLEN);
 	from->real[REALLEN] = '\0';
 
-	if (!(from->flags & USER_FLAG_REGISTERED) && from->nick[0]) {
+	if (!(from->flags & (USER_FLAG_REGISTERED | USER_FLAG_CAPNEG)) &&
+		from->nick[0]) {
 		ircClientWelcome(from);
 	}
 }
@@ -1141,17 +2577,21 @@ ircUserCommand(IrcUser *from, IrcMessage *msg)
 static void ICACHE_FLASH_ATTR
 ircVersionCommand(IrcUser *from, IrcMessage *msg)
 {
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+
+	if (!buf) {
+		return;
+	}
 
 	if (msg->params >= 1 &&
 		(strcasecmp(wifi_station_get_hostname(), msg->param[0]) != 0)) {
-		snprintf(buf, sizeof(buf), "402 %s %s :No such server", from->nick,
+		snprintf(buf, MSGLEN + 1, "402 %s %s :No such server", from->nick,
 		         msg->param[0]);
 		ircSend(from, buf);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), "351 %s %s. %s :Running on an ESP8266 wifi "
+	snprintf(buf, MSGLEN + 1, "351 %s %s. %s :Running on an ESP8266 wifi "
 	         "module!", from->nick, ESPIRCDVERSION,
 	         wifi_station_get_hostname());
 	ircSend(from, buf);
@@ -1161,17 +2601,21 @@ static void ICACHE_FLASH_ATTR
 ircWallopsCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcUser *user;
-	char buf[MSGLEN + 1];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
 	int i;
 
+	if (!buf) {
+		return;
+	}
+
 	if (!(from->flags & USER_FLAG_OPERATOR)) {
-		snprintf(buf, sizeof(buf), "481 %s :Permission Denied- You're not an "
+		snprintf(buf, MSGLEN + 1, "481 %s :Permission Denied- You're not an "
 		         "IRC operator", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), ":%s!%s@" IPSTR " WALLOPS :%s", from->nick,
+	snprintf(buf, MSGLEN + 1, ":%s!%s@" IPSTR " WALLOPS :%s", from->nick,
 	         from->user, IP2STR(&from->remote_ip), msg->param[0]);
 	for (i = 0; i < MAX_USERS; i++) {
 		user = &ircd.users[i];
@@ -1191,10 +2635,15 @@ static void ICACHE_FLASH_ATTR
 ircWhoCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcUser *user;
-	char buf[MSGLEN + 1], flags[4];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char flags[4];
 	char *p;
 	int i;
 
+	if (!buf) {
+		return;
+	}
+
 	if (msg->params < 1) {
 		for (i = 0; i < MAX_USERS; i++) {
 			user = &ircd.users[i];
@@ -1213,13 +2662,13 @@ ircWhoCommand(IrcUser *from, IrcMessage *msg)
 				*p++ = '*';
 			}
 			*p = '\0';
-			snprintf(buf, sizeof(buf), "352 %s * %s " IPSTR " %s %s %s :0 %s",
+			snprintf(buf, MSGLEN + 1, "352 %s * %s " IPSTR " %s %s %s :0 %s",
 			         from->nick, user->user, IP2STR(&user->remote_ip),
 			         wifi_station_get_hostname(), user->nick, flags,
 			         user->real);
 			ircSend(from, buf);
 		}
-		snprintf(buf, sizeof(buf), "315 %s * :End of WHO list", from->nick);
+		snprintf(buf, MSGLEN + 1, "315 %s * :End of WHO list", from->nick);
 		ircSend(from, buf);
 		return;
 	}
@@ -1235,14 +2684,14 @@ ircWhoCommand(IrcUser *from, IrcMessage *msg)
 				*p++ = '*';
 			}
 			*p = '\0';
-			snprintf(buf, sizeof(buf), "352 %s * %s " IPSTR " %s %s %s :0 %s",
+			snprintf(buf, MSGLEN + 1, "352 %s * %s " IPSTR " %s %s %s :0 %s",
 			         from->nick, user->user, IP2STR(&user->remote_ip),
 			         wifi_station_get_hostname(), user->nick, flags,
 			         user->real);
 			ircSend(from, buf);
 		}
 	}
-	snprintf(buf, sizeof(buf), "315 %s %s :End of WHO list", msg->param[0],
+	snprintf(buf, MSGLEN + 1, "315 %s %s :End of WHO list", msg->param[0],
 	         from->nick);
 	ircSend(from, buf);
 }
@@ -1251,90 +2700,171 @@ static void ICACHE_FLASH_ATTR
 ircWhoisCommand(IrcUser *from, IrcMessage *msg)
 {
 	IrcUser *user;
-	char buf[MSGLEN + 1], mode[19];
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	char mode[19];
 	int i;
 
+	if (!buf) {
+		return;
+	}
+
 	if (msg->params < 1) {
-		snprintf(buf, sizeof(buf), "431 %s :No nickname given", from->nick);
+		snprintf(buf, MSGLEN + 1, "431 %s :No nickname given", from->nick);
 		ircSend(from, buf);
 		return;
 	}
 
 	user = ircFindUserByNick(msg->param[0]);
 	if (user) {
-		snprintf(buf, sizeof(buf), "311 %s %s %s " IPSTR " * :%s", from->nick,
+		snprintf(buf, MSGLEN + 1, "311 %s %s %s " IPSTR " * :%s", from->nick,
 		         user->nick, user->user, IP2STR(&user->remote_ip),
 		         user->real);
 		ircSend(from, buf);
 
 		if (from->flags & USER_FLAG_OPERATOR) {
 			ircUserFlagsToMode(mode, user->flags, user->flags);
-			snprintf(buf, sizeof(buf), "379 %s %s :is using modes %s",
+			snprintf(buf, MSGLEN + 1, "379 %s %s :is using modes %s",
 			         from->nick, user->nick, mode);
 			ircSend(from, buf);
 
-			snprintf(buf, sizeof(buf), "378 %s %s :is connecting from *@"
+			snprintf(buf, MSGLEN + 1, "378 %s %s :is connecting from *@"
 			         IPSTR, from->nick, user->nick, IP2STR(&user->remote_ip));
 			ircSend(from, buf);
+
+			snprintf(buf, MSGLEN + 1, "320 %s %s :has sent %u lines (%u "
+			         "bytes), received %u lines (%u bytes), %u failed, %u "
+			         "dropped, sendq peak %u", from->nick, user->nick,
+			         (unsigned int)user->lines_in,
+			         (unsigned int)user->bytes_in,
+			         (unsigned int)user->lines_out,
+			         (unsigned int)user->bytes_out, user->send_fails,
+			         user->drops, user->sendq_peak);
+			ircSend(from, buf);
 		}
 
-		i = snprintf(buf, sizeof(buf), "319 %s %s :", from->nick, user->nick);
-		while (ircGetUserChans(user, buf + i, sizeof(buf) - i)) {
+		i = snprintf(buf, MSGLEN + 1, "319 %s %s :", from->nick, user->nick);
+		while (ircGetUserChans(user, buf + i, MSGLEN + 1 - i)) {
 			ircSend(from, buf);
 		}
 
-		snprintf(buf, sizeof(buf), "312 %s %s %s :ESP8266 network",
+		snprintf(buf, MSGLEN + 1, "312 %s %s %s :ESP8266 network",
 		         from->nick, user->nick, wifi_station_get_hostname());
 		ircSend(from, buf);
 
 		if (user->flags & USER_FLAG_OPERATOR) {
-			snprintf(buf, sizeof(buf), "313 %s %s :is an IRC Operator",
+			snprintf(buf, MSGLEN + 1, "313 %s %s :is an IRC Operator",
 			         from->nick, user->nick);
 			ircSend(from, buf);
 		}
+
+		if (user->srtt) {
+			snprintf(buf, MSGLEN + 1, "320 %s %s :has a round-trip time of "
+			         "%u ms", from->nick, user->nick, user->srtt);
+			ircSend(from, buf);
+		}
 		
 		// TODO: 317 idle
 	} else {
-		snprintf(buf, sizeof(buf), "401 %s %s :No such nick/channel",
+		snprintf(buf, MSGLEN + 1, "401 %s %s :No such nick/channel",
 		         from->nick, msg->param[0]);
 		ircSend(from, buf);
 	}
 
-	snprintf(buf, sizeof(buf), "318 %s %s :End of WHOIS list", msg->param[0],
+	snprintf(buf, MSGLEN + 1, "318 %s %s :End of WHOIS list", msg->param[0],
 	         from->nick);
 	ircSend(from, buf);
 }
 
+// cost is in lines against the flood bucket
 static IrcCommand userCommands[] = {
-	{"AWAY",    0, false, ircAwayCommand   },
-	{"INFO",    0, false, ircInfoCommand   },
-	{"JOIN",    1, false, ircJoinCommand   },
-	{"LUSERS",  0, false, ircLusersCommand },
-	{"MODE",    1, false, ircModeCommand   },
-	{"MOTD",    0, false, ircMotdCommand   },
-	{"NAMES",   0, false, ircNamesCommand  },
-	{"NICK",    0, true,  ircNickCommand   },
-	{"NOTICE",  0, false, ircNoticeCommand },
-	{"OPER",    2, false, ircOperCommand   },
-	{"PART",    1, false, ircPartCommand   },
-	{"PING",    0, false, ircPingCommand   },
-	{"PONG",    0, false, ircPongCommand   },
-	{"PRIVMSG", 0, false, ircPrivmsgCommand},
-	{"QUIT",    0, true,  ircQuitCommand   },
-	{"TOPIC",   1, false, ircTopicCommand  },
-	{"USER",    4, true,  ircUserCommand   },
-	{"VERSION", 0, false, ircVersionCommand},
-	{"WALLOPS", 1, false, ircWallopsCommand},
-	{"WHO",     0, false, ircWhoCommand    },
-	{"WHOIS",   0, false, ircWhoisCommand  },
-	{NULL,      0, false, NULL             },
+	{"AWAY",     0, false, 1, ircAwayCommand    },
+	{"CAP",      1, true,  1, ircCapCommand     },
+	{"INFO",     0, false, 1, ircInfoCommand    },
+	{"JOIN",     1, false, 3, ircJoinCommand    },
+	{"LOGLEVEL", 0, false, 1, ircLoglevelCommand},
+	{"LUSERS",   0, false, 1, ircLusersCommand  },
+	{"MODE",     1, false, 1, ircModeCommand    },
+	{"MONITOR",  1, false, 1, ircMonitorCommand },
+	{"MOTD",     0, false, 1, ircMotdCommand    },
+	{"NAMES",    0, false, 3, ircNamesCommand   },
+	{"NICK",     0, true,  1, ircNickCommand    },
+	{"NOTICE",   0, false, 1, ircNoticeCommand  },
+	{"OPER",     2, false, 1, ircOperCommand    },
+	{"PART",     1, false, 1, ircPartCommand    },
+	{"PING",     0, false, 1, ircPingCommand    },
+	{"PONG",     0, false, 1, ircPongCommand    },
+	{"PRIVMSG",  0, false, 1, ircPrivmsgCommand },
+	{"QUIT",     0, true,  1, ircQuitCommand    },
+	{"RESUME",   1, true,  1, ircResumeCommand  },
+	{"SILENCE",  0, false, 1, ircSilenceCommand },
+	{"STATS",    0, false, 1, ircStatsCommand   },
+	{"TOPIC",    1, false, 1, ircTopicCommand   },
+	{"USER",     4, true,  1, ircUserCommand    },
+	{"VERSION",  0, false, 1, ircVersionCommand },
+	{"WALLOPS",  1, false, 1, ircWallopsCommand },
+	{"WHO",      0, false, 3, ircWhoCommand     },
+	{"WHOIS",    0, false, 3, ircWhoisCommand   },
+	{NULL,       0, false, 0, NULL              },
 };
 
+/*
+ * A line per command ever called, so with the fan-out and end lines up to
+ * 29.  The whole report is one event's burst, which the sendq backlog does
+ * not count; SENDQ_LINES still stays above it for a client that asks again
+ * before the first report is acknowledged.
+ */
+static void ICACHE_FLASH_ATTR
+ircStatsCommands(IrcUser *from, bool reset)
+{
+	char *buf = ircScratchAlloc(MSGLEN + 1);
+	IrcCommand *cmd;
+	char pcts[32];
+	uint32 calls;
+
+	if (!buf) {
+		return;
+	}
+
+	for (cmd = userCommands; cmd->name; cmd++) {
+		calls = cmd->calls - cmd->base_calls;
+		if (!calls) {
+			continue;
+		}
+
+		ircHistText(pcts, sizeof(pcts), &cmd->latency);
+		snprintf(buf, MSGLEN + 1, "212 %s %s %u %u %u :calls, errors, "
+		         "handler us (avg %u), latency p50/p90/p99 %s us",
+		         from->nick, cmd->name, (unsigned int)calls,
+		         (unsigned int)(cmd->errors - cmd->base_errors),
+		         (unsigned int)cmd->handler_us,
+		         (unsigned int)(cmd->handler_us / calls), pcts);
+		ircSend(from, buf);
+
+		if (reset) {
+			cmd->base_calls = cmd->calls;
+			cmd->base_errors = cmd->errors;
+			cmd->handler_us = 0;
+			bzero(&cmd->latency, sizeof(IrcHist));
+		}
+	}
+
+	ircHistText(pcts, sizeof(pcts), &ircd.fanout);
+	snprintf(buf, MSGLEN + 1, "249 %s :channel fan-out p50/p90/p99 %s us",
+	         from->nick, pcts);
+	ircSend(from, buf);
+	if (reset) {
+		bzero(&ircd.fanout, sizeof(IrcHist));
+	}
+}
+
 static void ICACHE_FLASH_ATTR
 ircClientCommand(IrcUser *user, IrcMessage *msg)
 {
 	IrcCommand *cmd = userCommands;
-	char buf[MSGLEN + 1];
+	size_t mark = ircScratchMark();
+	uint16 errors, lines;
+	uint32 start;
+	char *buf;
 
 	while (cmd->name) {
 		if (strcmp(msg->cmd, cmd->name) != 0) {
@@ -1342,30 +2872,59 @@ ircClientCommand(IrcUser *user, IrcMessage *msg)
 			continue;
 		}
 
+		user->flood_tokens -= cmd->cost * 1000;
+		cmd->calls++;
+
 		if (!(user->flags & USER_FLAG_REGISTERED) & !cmd->for_registration) {
+			cmd->errors++;
 			break;
 		}
 
 		if (cmd->required_params && ((cmd->required_params > msg->params) ||
 			!msg->param[cmd->required_params - 1][0])) {
-			snprintf(buf, sizeof(buf), "461 %s %s :Not enough parameters",
-			         user->nick, msg->cmd);
-			ircSend(user, buf);
+			buf = ircScratchAlloc(MSGLEN + 1);
+			if (buf) {
+				snprintf(buf, MSGLEN + 1, "461 %s %s :Not enough parameters",
+				         user->nick, msg->cmd);
+				ircSend(user, buf);
+			}
+			cmd->errors++;
+			ircScratchRelease(mark);
 			return;
 		}
 
+		// handlers take their buffers from the arena without freeing them
+		errors = ircd.error_replies;
+		lines = ircd.event_lines;
+		start = system_get_time();
+		TRACE_BEGIN(cmd->name, user->index);
 		cmd->handler(user, msg);
+		TRACE_END(cmd->name, user->index);
+		cmd->handler_us += system_get_time() - start;
+		// from the arrival of the line, held or not, to its last reply
+		ircHistAdd(&cmd->latency, (ircd.event_lines != lines ?
+		           ircd.sent_us : system_get_time()) - user->line_us);
+		if (ircd.error_replies != errors) {
+			cmd->errors++;
+		}
+		ircScratchRelease(mark);
 		return;
 	}
 
+	user->flood_tokens -= 1000;
+	buf = ircScratchAlloc(MSGLEN + 1);
+	if (!buf) {
+		return;
+	}
 	if (!(user->flags & USER_FLAG_REGISTERED)) {
-		snprintf(buf, sizeof(buf), "451 %s :You have not registered",
+		snprintf(buf, MSGLEN + 1, "451 %s :You have not registered",
 		         msg->cmd);
 		ircSend(user, buf);
 	} else {
-		snprintf(buf, sizeof(buf), "421 %s :Unknown command", msg->cmd);
+		snprintf(buf, MSGLEN + 1, "421 %s :Unknown command", msg->cmd);
 		ircSend(user, buf);
 	}
+	ircScratchRelease(mark);
 }
 
 static bool ICACHE_FLASH_ATTR
@@ -1419,44 +2978,489 @@ ircParse(char *s, IrcMessage *msg)
 }
 
 static void ICACHE_FLASH_ATTR
-ircdTimerCb(void *arg)
+ircFloodRefill(IrcUser *user)
+{
+	uint32 t = system_get_time();
+	uint32 elapsed = t - user->flood_stamp;
+	uint32 burst = user->cls->flood_burst, rate = user->cls->flood_rate;
+
+	// a full bucket's worth of time; also keeps the product in range
+	if (elapsed > burst * 1000000 / rate) {
+		elapsed = burst * 1000000 / rate;
+	}
+	user->flood_stamp = t;
+	user->flood_tokens += elapsed * rate / 1000;
+	if (user->flood_tokens > (sint32)burst * 1000) {
+		user->flood_tokens = burst * 1000;
+	}
+}
+
+// input stays held while the client floods, its sends are refused, or it
+// has no buffer and none is free
+static void ICACHE_FLASH_ATTR
+ircUserHoldUpdate(IrcUser *user)
+{
+	if (user->flood || (!user->msgbuf && ircd.pool_full) ||
+		(user->flags & (USER_FLAG_BLOCKED | USER_FLAG_THROTTLED))) {
+		espconn_recv_hold(ircUserConn(user));
+	} else {
+		espconn_recv_unhold(ircUserConn(user));
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+ircFloodArm(void)
+{
+	if (!ircd.flood_armed) {
+		os_timer_arm(&ircd.flood_timer, FLOOD_TICK, 1);
+		ircd.flood_armed = true;
+	}
+}
+
+/*
+ * With nowhere to park its input, a client over budget has what was
+ * already read go through, and reading stops until the bucket refills.
+ */
+static void ICACHE_FLASH_ATTR
+ircFloodThrottle(IrcUser *user)
+{
+	if (user->flags & USER_FLAG_THROTTLED) {
+		return;
+	}
+
+	if (!user->flood && ircd.now - user->flood_unheld > FLOOD_HOLD_GAP) {
+		user->flood_since = ircd.now;
+	}
+	user->flags |= USER_FLAG_THROTTLED;
+	ircUserHoldUpdate(user);
+	ircFloodArm();
+}
+
+// a hold buffer for the client's input, which stops being read meanwhile
+static IrcFlood * ICACHE_FLASH_ATTR
+ircFloodSlot(IrcUser *user)
 {
+	IrcFlood *flood = NULL;
 	int i;
-	char buf[MSGLEN + 1];
-	IrcUser *user;
 
-	for (i = 0; i < MAX_USERS; i++) {
-		user = &ircd.users[i];
+	if (user->flood) {
+		return user->flood;
+	}
+
+	for (i = 0; i < FLOOD_HOLD_SLOTS; i++) {
+		if (!ircd.flood[i].user) {
+			flood = &ircd.flood[i];
+			break;
+		}
+	}
+	if (!flood) {
+		ircd.alloc_fails++;
+		return NULL;
+	}
+
+	flood->user = user;
+	flood->len = 0;
+	user->flood = flood;
+	if (ircd.now - user->flood_unheld > FLOOD_HOLD_GAP) {
+		user->flood_since = ircd.now;
+	}
+	ircUserHoldUpdate(user);
+	ircFloodArm();
+	return flood;
+}
+
+/*
+ * Parks the line in msgbuf and the unread input after it until the bucket
+ * refills.  The input may itself lie in the hold buffer, behind the line.
+ * Returns false if it could not be parked: the client is then throttled,
+ * unless it has been held too long and has to go.
+ */
+static bool ICACHE_FLASH_ATTR
+ircFloodHold(IrcUser *user, const char *rest, size_t len)
+{
+	IrcFlood *flood = user->flood;
+	size_t linelen = strlen(user->msgbuf);
+
+	if (flood && ircd.now - user->flood_since > FLOOD_HOLD_MAX) {
+		return false;
+	}
+	if (linelen + 1 + len > FLOOD_BUFLEN ||
+		(!flood && !(flood = ircFloodSlot(user)))) {
+		ircFloodThrottle(user);
+		return false;
+	}
+
+	memmove(flood->buf + linelen + 1, rest, len);
+	memcpy(flood->buf, user->msgbuf, linelen);
+	flood->buf[linelen] = '\n';
+	flood->len = linelen + 1 + len;
+	flood->arrived_us = user->line_us;
+	user->msgbuf[0] = 0;
+	ircUserSleep(user); // until the input is let through again
+	return true;
+}
+
+static void ICACHE_FLASH_ATTR
+ircUserInput(IrcUser *user, const char *data, size_t len)
+{
+	char c;
+	char *dst;
+	const char *src;
+	IrcMessage msg;
+	bool parsed;
+
+	src = data;
+	dst = user->msgbuf + strlen(user->msgbuf);
+
+	while (src < data + len) {
+		c = *src++;
+		if (c == 0 || c == '\r') {
+			continue;
+		}
+
+		if (c == '\n') {
+			*dst = 0;
+
+			ircFloodRefill(user);
+			if (user->flood_tokens <= 0 &&
+				!(user->flags & USER_FLAG_THROTTLED)) {
+				if (ircFloodHold(user, src, data + len - src)) {
+					return;
+				}
+				if (ircd.now - user->flood_since > FLOOD_HOLD_MAX) {
+					ircDisconnect(user, "QUIT", NULL, "Excess Flood");
+					return;
+				}
+			}
+
+			dst = user->msgbuf;
+			user->lines_in++;
+			ircd.lines_in++;
+
+			log_printf(LOG_DEBUG, "u%2d >> %s\n", user->index, user->msgbuf);
+
+			TRACE_BEGIN("parse", user->index);
+			parsed = ircParse(user->msgbuf, &msg);
+			TRACE_END("parse", user->index);
+			if (parsed) {
+				ircClientCommand(user, &msg);
+			}
+			if (!(user->flags & USER_FLAG_CONNECTED)) {
+				return;
+			}
+			continue;
+		}
+
+		if (dst == user->msgbuf) {
+			user->line_us = ircd.input_us;
+		}
+		if (dst < user->msgbuf + MSGLEN) {
+			*dst++ = c;
+		}
+	}
+	*dst = 0;
+}
+
+/*
+ * More input than the hold buffer takes: what is parked goes through now,
+ * and the client is throttled instead until its bucket refills.
+ */
+static void ICACHE_FLASH_ATTR
+ircFloodFlush(IrcUser *user)
+{
+	IrcFlood *flood = user->flood;
+	uint16 len = flood->len;
+
+	ircFloodThrottle(user);
+	flood->len = 0;
+	ircd.input_us = flood->arrived_us;
+	ircUserInput(user, flood->buf, len);
+	ircd.input_us = ircd.event_us;
+	if (flood->user != user) {
+		return; // disconnected
+	}
+
+	flood->user = NULL;
+	user->flood = NULL;
+	ircUserHoldUpdate(user);
+}
+
+/*
+ * Input for a client that could not get a receive buffer.  Its complete
+ * lines are read through a scratch line; an unfinished last line waits in
+ * a hold buffer, with the connection held, until a receive buffer frees.
+ * The input may be the hold buffer's own, parked earlier.
+ */
+static void ICACHE_FLASH_ATTR
+ircUserStarve(IrcUser *user, const char *data, size_t len)
+{
+	size_t mark = ircScratchMark();
+	const char *tail = data + len;
+	IrcFlood *flood;
+	char *line = NULL;
+	size_t n;
+
+	while (tail > data && tail[-1] != '\n') {
+		tail--;
+	}
+
+	if (tail > data) {
+		line = ircScratchAlloc(MSGLEN + 1);
+	}
+	if (line) {
+		line[0] = 0;
+		user->msgbuf = line;
+		ircUserInput(user, data, tail - data);
+		if (user->msgbuf == line) {
+			user->msgbuf = NULL;
+		}
 		if (!(user->flags & USER_FLAG_CONNECTED)) {
+			ircScratchRelease(mark);
+			return;
+		}
+	} else {
+		tail = data;
+	}
+	ircScratchRelease(mark);
+
+	// past MSGLEN the line is cut short anyway
+	n = data + len - tail;
+	if (n > MSGLEN) {
+		n = MSGLEN;
+	}
+	if (!n) {
+		return;
+	}
+
+	flood = ircFloodSlot(user);
+	if (!flood || flood->len + n > FLOOD_BUFLEN) {
+		log_printf(LOG_ERROR, "u%2d no buffer for input, %u bytes lost\n",
+		           user->index, (unsigned int)n);
+		return;
+	}
+	if (!flood->len) {
+		flood->arrived_us = ircd.input_us;
+	}
+	memmove(flood->buf + flood->len, tail, n); // may come from there
+	flood->len += n;
+}
+
+static uint32 ICACHE_FLASH_ATTR
+ircPongWait(IrcUser *user)
+{
+	uint32 wait = PONG_WAIT_MIN;
+
+	// slow or jittery links get a proportionally longer grace period
+	if (user->srtt) {
+		wait += 16 * (user->srtt + 4 * user->rttvar) / 1000;
+	}
+	return wait > PONG_WAIT_MAX ? PONG_WAIT_MAX : wait;
+}
+
+/*
+ * Any received line clears sent_ping, so a client that talks never sees
+ * a keepalive.  Idle clients get a tokenised PING; its PONG feeds the RTT
+ * estimate and stretches the keepalive interval.
+ */
+static void ICACHE_FLASH_ATTR
+ircUserTimeout(IrcUser *user)
+{
+	uint32 idle = ircd.now - user->last_recv;
+	char buf[40];
+
+	if (user->msgbuf && !user->msgbuf[0] && !user->flood &&
+		idle >= HIBERNATE_IDLE) {
+		ircUserSleep(user);
+	}
+
+	if (user->flags & USER_FLAG_DETACHED) {
+		ircDisconnect(user, "QUIT", NULL, "Connection lost");
+	} else if (!(user->flags & USER_FLAG_REGISTERED)) {
+		snprintf(buf, sizeof(buf), "Registration timeout: %d seconds",
+		         (int)(ircd.now - user->connect_time));
+		ircd.timeouts++;
+		ircDisconnect(user, "QUIT", NULL, buf);
+	} else if (!user->msgbuf && ircd.pool_full) {
+		// held for want of a buffer, so no PONG could get in
+		ircTimerSchedule(user, ircd.now + ircPongWait(user));
+	} else if (user->sent_ping) {
+		snprintf(buf, sizeof(buf), "Ping timeout: %d seconds", (int)idle);
+		ircd.timeouts++;
+		ircDisconnect(user, "QUIT", NULL, buf);
+	} else if (!ircWantsPing(user)) {
+		// only woken up to hibernate; left unscheduled after that
+		if (user->msgbuf) {
+			ircTimerSchedule(user, user->last_recv + HIBERNATE_IDLE);
+		}
+	} else if (idle < user->ping_interval) {
+		ircTimerSchedule(user, user->last_recv + user->ping_interval);
+	} else {
+		user->ping_sent = system_get_time() | 1;
+		snprintf(buf, sizeof(buf), "PING :%x",
+		         (unsigned int)user->ping_sent);
+		ircSend(user, buf);
+		user->sent_ping = true;
+		ircTimerSchedule(user, ircd.now + ircPongWait(user));
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+ircdTimerCb(void *arg)
+{
+	IrcUser *user;
+	uint32 ticks, tick;
+
+	ircdEventEnter(__builtin_frame_address(0));
+	ircd.timer_armed = false;
+	ircd.timer_busy = true;
+
+	// after a long sleep one revolution visits every bucket
+	ticks = ircd.now - ircd.wheel_tick;
+	if (ticks > WHEEL_SLOTS) {
+		ticks = WHEEL_SLOTS;
+	}
+
+	for (tick = ircd.wheel_tick + 1; ticks; tick++, ticks--) {
+		user = ircd.wheel[tick & (WHEEL_SLOTS - 1)];
+		while (user) {
+			if ((sint32)(user->deadline - ircd.now) > 0) {
+				user = user->timer_next;
+				continue;
+			}
+
+			// handling may relink this bucket, so start over
+			ircTimerCancel(user);
+			ircUserTimeout(user);
+			user = ircd.wheel[tick & (WHEEL_SLOTS - 1)];
+		}
+	}
+	ircd.wheel_tick = ircd.now;
+
+	ircd.timer_busy = false;
+	ircdTimerRearm();
+	ircdEventLeave();
+}
+
+static void ICACHE_FLASH_ATTR
+ircdFloodTimerCb(void *arg)
+{
+	IrcFlood *flood;
+	IrcUser *user;
+	bool held = false;
+	uint16 len;
+	int i;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	for (i = 0; i < FLOOD_HOLD_SLOTS; i++) {
+		flood = &ircd.flood[i];
+		user = flood->user;
+		if (!user) {
 			continue;
 		}
 
-		if (!(user->flags & USER_FLAG_REGISTERED) &&
-			(user->last_recv >= UNREGISTERED_TIMEOUT)) {
-			snprintf(buf, sizeof(buf), "Ping timeout: %d seconds",
-			         user->last_recv);
-			ircDisconnect(user, "QUIT", NULL, buf);
+		ircFloodRefill(user);
+		if (user->flood_tokens <= 0) {
+			if (ircd.now - user->flood_since > FLOOD_HOLD_MAX) {
+				ircDisconnect(user, "QUIT", NULL, "Excess Flood");
+			} else {
+				held = true;
+			}
+			continue;
 		}
 
-		if (user->sent_ping && user->last_recv < PING_TIME) {
-			user->sent_ping = false;
+		// without a receive buffer only the complete lines can go
+		len = flood->len;
+		flood->len = 0;
+		ircd.input_us = flood->arrived_us;
+		if (ircUserWake(user)) {
+			ircUserInput(user, flood->buf, len);
+		} else {
+			ircUserStarve(user, flood->buf, len);
+		}
+		ircd.input_us = ircd.event_us;
+		if (flood->user != user) {
+			continue; // disconnected
+		}
+		if (flood->len) {
+			held = true;
+			continue;
 		}
 
-		if (!user->sent_ping && user->last_recv >= PING_TIME) {
-			snprintf(buf, sizeof(buf), "PING :%s",
-			         wifi_station_get_hostname());
-			ircSend(user, buf);
-			user->sent_ping = true;
+		flood->user = NULL;
+		user->flood = NULL;
+		user->flood_unheld = ircd.now;
+		ircUserHoldUpdate(user);
+	}
+
+	for (i = 0; i < MAX_USERS; i++) {
+		user = &ircd.users[i];
+		if (!(user->flags & USER_FLAG_THROTTLED)) {
+			continue;
 		}
-		
-		if (user->last_recv >= PING_TIMEOUT) {
-			snprintf(buf, sizeof(buf), "Ping timeout: %d seconds",
-			         user->last_recv);
-			ircDisconnect(user, "QUIT", NULL, buf);
+
+		ircFloodRefill(user);
+		if (user->flood_tokens > 0) {
+			user->flags &= ~USER_FLAG_THROTTLED;
+			user->flood_unheld = ircd.now;
+			ircUserHoldUpdate(user);
+		} else if (ircd.now - user->flood_since > FLOOD_HOLD_MAX) {
+			ircDisconnect(user, "QUIT", NULL, "Excess Flood");
+		} else {
+			held = true;
+		}
+	}
+
+	if (!held) {
+		os_timer_disarm(&ircd.flood_timer);
+		ircd.flood_armed = false;
+	}
+	ircdEventLeave();
+}
+
+/*
+ * Keeps the session of a client that lost its link and asked for resume.
+ * It stays in its channels while lines for it collect in a replay buffer.
+ * Returns false if the client has to be disconnected after all.
+ */
+static bool ICACHE_FLASH_ATTR
+ircDetach(IrcUser *user)
+{
+	int i;
+
+	if (!(user->flags & USER_FLAG_REGISTERED) ||
+		!(user->caps & USER_CAP_RESUME)) {
+		return false;
+	}
+
+	for (i = 0; i < RESUME_SLOTS; i++) {
+		if (!ircd.replay[i].user) {
+			break;
 		}
+	}
+	if (i == RESUME_SLOTS) {
+		ircd.alloc_fails++;
+		return false;
+	}
 
-		user->last_recv++;
+	ircd.replay[i].user = user;
+	ircd.replay[i].len = 0;
+	user->replay = &ircd.replay[i];
+
+	if (user->flood) {
+		user->flood->user = NULL;
+		user->flood = NULL;
 	}
+	user->flags |= USER_FLAG_DETACHED;
+	user->flags &= ~(USER_FLAG_SENDQ | USER_FLAG_BLOCKED |
+	                 USER_FLAG_THROTTLED);
+	user->remote_port = 0; // the old connection must no longer match
+	user->sendq = 0;
+	user->sendq_mark = 0;
+	ircUserSleep(user);
+	ircTimerSchedule(user, ircd.now + RESUME_GRACE);
+	log_printf(LOG_INFO, "u%2d detached\n", user->index);
+	return true;
 }
 
 static IrcUser * ICACHE_FLASH_ATTR
@@ -1483,122 +3487,626 @@ ircdFindUserData(struct espconn *conn)
 static void ICACHE_FLASH_ATTR
 ircdClientRecvCb(struct espconn *conn, char *data, unsigned short len)
 {
-	char c;
-	char *dst, *src;
 	IrcUser *user;
-	IrcMessage msg;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	user = ircdFindUserData(conn);
+	if (!user) {
+		goto leave;
+	}
+
+	TRACE_BEGIN("recv", user->index);
+	user->last_recv = ircd.now;
+	user->sent_ping = false;
+	user->bytes_in += len;
+	ircd.bytes_in += len;
+
+	if (user->flood) {
+		// already in flight when the hold went up
+		if (user->flood->len + len <= FLOOD_BUFLEN) {
+			if (!user->flood->len) {
+				user->flood->arrived_us = ircd.event_us;
+			}
+			memcpy(user->flood->buf + user->flood->len, data, len);
+			user->flood->len += len;
+		} else if (ircUserWake(user)) {
+			ircFloodFlush(user);
+			if (user->flags & USER_FLAG_CONNECTED) {
+				ircUserInput(user, data, len);
+			}
+		} else {
+			log_printf(LOG_ERROR, "u%2d no buffer for input, %u bytes "
+			           "lost\n", user->index, (unsigned int)len);
+		}
+	} else if (!ircUserWake(user)) {
+		ircUserStarve(user, data, len);
+	} else {
+		if (!user->timer_pprev) {
+			ircTimerSchedule(user, ircd.now + HIBERNATE_IDLE);
+		}
+		ircUserInput(user, data, len);
+	}
+	TRACE_END("recv", user->index);
+
+leave:
+	ircdEventLeave();
+}
+
+static void ICACHE_FLASH_ATTR
+ircdClientDisconnectCb(struct espconn *conn)
+{
+	IrcUser *user;
+
+	ircdEventEnter(__builtin_frame_address(0));
 
 	user = ircdFindUserData(conn);
 	if (!user) {
+		goto leave;
+	}
+
+	log_printf(LOG_INFO, "u%2d disconnected\n", user->index);
+	if (!ircDetach(user)) {
+		user->flags &= ~USER_FLAG_CONNECTED;
+		ircDisconnect(user, "QUIT", NULL, "Client exited");
+	}
+
+leave:
+	ircdEventLeave();
+}
+
+// not an event: nothing is formatted here
+static void ICACHE_FLASH_ATTR
+ircdClientSentCb(struct espconn *conn)
+{
+	IrcUser *user = ircdFindUserData(conn);
+
+	if (!user || !user->sendq) {
 		return;
 	}
 
-	user->last_recv = 0;
+	user->sendq--;
+	if (user->sendq_mark) {
+		user->sendq_mark--; // acknowledged oldest first
+	}
+	if ((user->flags & USER_FLAG_BLOCKED) && !user->sendq) {
+		user->flags &= ~USER_FLAG_BLOCKED;
+		ircUserHoldUpdate(user);
+	}
+}
 
-	src = data;
-	dst = user->msgbuf + strlen(user->msgbuf);
+static void ICACHE_FLASH_ATTR
+ircdClientReconCb(struct espconn *conn, sint8 err)
+{
+	IrcUser *user;
+	char reason[24];
 
-	while (src < data + len) {
-		c = *src++;
-		if (c == 0 || c == '\r') {
+	ircdEventEnter(__builtin_frame_address(0));
+
+	// aborted connections, including failed keepalive probes, end up here
+	user = ircdFindUserData(conn);
+	if (!user) {
+		goto leave;
+	}
+
+	log_printf(LOG_WARN, "u%2d connection error %d\n", user->index, err);
+	if (!ircDetach(user)) {
+		user->flags &= ~USER_FLAG_CONNECTED;
+		snprintf(reason, sizeof(reason), "Connection error %d", err);
+		ircDisconnect(user, "QUIT", NULL, reason);
+	}
+
+leave:
+	ircdEventLeave();
+}
+
+/*
+ * Counts a connect from ip against its THROTTLE_WINDOW.  The table is
+ * small, so a new address takes over the entry with the oldest window.
+ */
+static bool ICACHE_FLASH_ATTR
+ircdThrottled(const uint8 *ip)
+{
+	IrcThrottle *entry = NULL;
+	IrcThrottle *oldest = &ircd.throttle[0];
+	int i;
+
+	for (i = 0; i < THROTTLE_SLOTS; i++) {
+		if (memcmp(ircd.throttle[i].ip, ip, 4) == 0) {
+			entry = &ircd.throttle[i];
+			break;
+		}
+		if ((sint32)(ircd.throttle[i].since - oldest->since) < 0) {
+			oldest = &ircd.throttle[i];
+		}
+	}
+
+	if (!entry || ircd.now - entry->since >= THROTTLE_WINDOW) {
+		if (!entry) {
+			entry = oldest;
+			memcpy(entry->ip, ip, 4);
+		}
+		entry->count = 0;
+		entry->since = ircd.now;
+	}
+
+	if (entry->count < 255) {
+		entry->count++;
+	}
+	return entry->count > THROTTLE_MAX;
+}
+
+static int ICACHE_FLASH_ATTR
+ircdClassUsers(IrcClass *cls)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAX_USERS; i++) {
+		if ((ircd.users[i].flags & USER_FLAG_CONNECTED) &&
+		    ircd.users[i].cls == cls) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static IrcClass * ICACHE_FLASH_ATTR
+ircdFindClass(const uint8 *ip, uint16 port)
+{
+	IrcClass *cls;
+	uint32 addr = ((uint32)ip[0] << 24) | ((uint32)ip[1] << 16) |
+	              ((uint32)ip[2] << 8) | ip[3];
+	uint32 net, mask;
+
+	for (cls = ircClasses; cls->name; cls++) {
+		if (cls->port && cls->port != port) {
 			continue;
 		}
 
-		if (c == '\n') {
-			*dst = 0;
-			dst = user->msgbuf;
+		net = ((uint32)cls->ip[0] << 24) | ((uint32)cls->ip[1] << 16) |
+		      ((uint32)cls->ip[2] << 8) | cls->ip[3];
+		mask = cls->prefix ? 0xffffffff << (32 - cls->prefix) : 0;
+		if ((addr & mask) == (net & mask)) {
+			return cls;
+		}
+	}
+	return NULL;
+}
 
-#ifdef DEBUG
-			printf("u%2d >> %s\n", user->index, user->msgbuf);
-#endif
+/*
+ * Makes room for a new connection at the expense of slots that never
+ * registered.  Slots still owed to other classes' reservations don't
+ * count as free.  Returns a free slot, or NULL if nothing could be shed.
+ */
+static IrcUser * ICACHE_FLASH_ATTR
+ircdClaimSlot(IrcClass *cls, bool *full)
+{
+	IrcUser *user, *slot = NULL, *oldest = NULL;
+	IrcClass *other;
+	int i, n, unregistered = 0, free_slots = 0, held = 0, limit;
+
+	for (other = ircClasses; other->name; other++) {
+		n = ircdClassUsers(other);
+		if (other != cls && n < other->reserved) {
+			held += other->reserved - n;
+		}
+	}
 
-			if (ircParse(user->msgbuf, &msg)) {
-				ircClientCommand(user, &msg);
+	for (i = 0; i < MAX_USERS; i++) {
+		user = &ircd.users[i];
+		if (!(user->flags & USER_FLAG_CONNECTED)) {
+			if (!slot) {
+				slot = user;
 			}
+			free_slots++;
 			continue;
 		}
 
-		if (dst < user->msgbuf + MSGLEN) {
-			*dst++ = c;
+		if (user->flags & USER_FLAG_REGISTERED) {
+			continue;
+		}
+
+		unregistered++;
+		if (!oldest || (sint32)(user->connect_time - oldest->connect_time) < 0) {
+			oldest = user;
 		}
 	}
-	*dst = 0;
+
+	// the slots registered clients leave, less other classes' reservations
+	limit = (free_slots + unregistered - held) * UNREGISTERED_PCT / 100;
+	if (limit < MIN_UNREGISTERED) {
+		limit = MIN_UNREGISTERED;
+	}
+
+	*full = free_slots <= held;
+	if (!*full && unregistered < limit) {
+		return slot;
+	}
+
+	if (!oldest || ircd.now - oldest->connect_time < UNREGISTERED_GRACE) {
+		return NULL;
+	}
+
+	log_printf(LOG_INFO, "u%2d shed while unregistered\n", oldest->index);
+	ircDisconnect(oldest, "QUIT", NULL, "Registration timeout");
+	return oldest;
 }
 
 static void ICACHE_FLASH_ATTR
-ircdClientDisconnectCb(struct espconn *conn)
+ircdClientReject(struct espconn *conn, const char *reason)
 {
-	IrcUser *user = ircdFindUserData(conn);
+	char *buf = ircScratchAlloc(MSGLEN + 3);
 
-	if (!user) {
-		return;
+	if (buf) {
+		snprintf(buf, MSGLEN + 3, "ERROR :%s\r\n", reason);
+		log_printf(LOG_WARN, "u-1 << ERROR :%s\n", reason);
+		espconn_sent(conn, (unsigned char *)buf, strlen(buf));
 	}
-
-	user->flags &= ~USER_FLAG_CONNECTED;
-#ifdef DEBUG
-	printf("u%2d disconnected\n", user->index);
-#endif
-	ircDisconnect(user, "QUIT", NULL, "Client exited");
+	espconn_disconnect(conn);
+	log_printf(LOG_INFO, "u-1 disconnected\n");
 }
 
 static void ICACHE_FLASH_ATTR
 ircdClientConnectCb(struct espconn *conn)
 {
 	IrcUser *user;
-	int i;
+	IrcClass *cls;
+	uint32 keepalive;
+	bool full;
+	int i, listener;
 
-	for (i = 0; i < MAX_USERS; i++) {
-		user = &ircd.users[i];
-		if (!(user->flags & USER_FLAG_CONNECTED)) {
+	ircdEventEnter(__builtin_frame_address(0));
+
+	if (ircdThrottled(conn->proto.tcp->remote_ip)) {
+		ircdClientReject(conn, "Closing Link: (Too many connections from "
+		                 "your host, try again later)");
+		goto leave;
+	}
+
+	for (listener = ircd.listeners - 1; listener > 0; listener--) {
+		if (ircd.listen[listener].tcp.local_port ==
+		    conn->proto.tcp->local_port) {
 			break;
 		}
 	}
-	if (i == MAX_USERS) {
-#ifdef DEBUG
-		printf("u-1 << %s", "ERROR :SERVER IS FULL\n");
-#endif
-		espconn_sent(conn, (unsigned char *)"ERROR :SERVER IS FULL\r\n", 23);
-		espconn_disconnect(conn);
-#ifdef DEBUG
-		printf("u-1 disconnected\n");
-#endif
-		return;
+
+	cls = ircdFindClass(conn->proto.tcp->remote_ip,
+	                    ircd.listen[listener].tcp.local_port);
+	if (!cls) {
+		ircdClientReject(conn, "Closing Link: (No class for your host)");
+		goto leave;
+	}
+	if (ircdClassUsers(cls) >= cls->max_conns) {
+		ircdClientReject(conn, "Closing Link: (Too many connections in your "
+		                 "class)");
+		goto leave;
 	}
 
+	user = ircdClaimSlot(cls, &full);
+	if (!user) {
+		ircdClientReject(conn, full ? "SERVER IS FULL" : "Closing Link: "
+		                 "(Too many unregistered connections, try again later)");
+		goto leave;
+	}
+	i = user - ircd.users;
+
+	ircTimerCancel(user);
 	bzero(user, sizeof(IrcUser));
 	memcpy(user->remote_ip, conn->proto.tcp->remote_ip, 4);
 	user->remote_port = conn->proto.tcp->remote_port;
 	user->flags |= USER_FLAG_CONNECTED;
 	user->index = i;
+	user->listener = listener;
+	user->cls = cls;
+	user->connect_time = ircd.now;
+	user->last_recv = ircd.now;
+	user->flood_tokens = cls->flood_burst * 1000;
+	user->flood_stamp = system_get_time();
+	ircd.connects++;
+	ircTimerSchedule(user, ircd.now + UNREGISTERED_TIMEOUT);
 
 	espconn_regist_recvcb(conn, (void (*)(void *, char *, unsigned short))
 						  ircdClientRecvCb);
 	espconn_regist_disconcb(conn, (void (*)(void *))ircdClientDisconnectCb);
+	espconn_regist_reconcb(conn, (void (*)(void *, sint8))ircdClientReconCb);
+	espconn_regist_sentcb(conn, (void (*)(void *))ircdClientSentCb);
+
+	if (espconn_set_opt(conn, ESPCONN_KEEPALIVE) == ESPCONN_OK) {
+		keepalive = TCP_KEEPIDLE;
+		espconn_set_keepalive(conn, ESPCONN_KEEPIDLE, &keepalive);
+		keepalive = TCP_KEEPINTVL;
+		espconn_set_keepalive(conn, ESPCONN_KEEPINTVL, &keepalive);
+		keepalive = TCP_KEEPCNT;
+		espconn_set_keepalive(conn, ESPCONN_KEEPCNT, &keepalive);
+
+		// probes carry no data, so the idle timer must not kill the link
+		espconn_regist_time(conn, 0, 1);
+		user->flags |= USER_FLAG_KEEPALIVE;
+	}
 
-#ifdef DEBUG
-	printf("u%2d connected\n", i);
-#endif
+	log_printf(LOG_INFO, "u%2d connected\n", i);
+
+leave:
+	ircdEventLeave();
+}
+
+static void ICACHE_FLASH_ATTR
+ircdListen(int port)
+{
+	IrcListener *listener;
+
+	if (ircd.listeners == MAX_LISTEN) {
+		log_printf(LOG_ERROR, "no listener left for port %d\n", port);
+		return;
+	}
+	listener = &ircd.listen[ircd.listeners++];
+
+	listener->conn.type = ESPCONN_TCP;
+	listener->conn.state = ESPCONN_NONE;
+	listener->tcp.local_port = port;
+	listener->conn.proto.tcp = &listener->tcp;
+
+	espconn_regist_connectcb(&listener->conn, (void (*)(void *))
+							 ircdClientConnectCb);
+	espconn_accept(&listener->conn);
+	espconn_regist_time(&listener->conn, PING_TIMEOUT + 60, 0);
+	espconn_tcp_set_max_con_allow(&listener->conn, MAX_USERS + 1);
 }
 
 void ICACHE_FLASH_ATTR
 ircdInit(int port)
 {
-	bzero(&ircd, sizeof(ircd));
+	IrcClass *cls;
+	int i;
 
-	ircd.conn.type = ESPCONN_TCP;
-	ircd.conn.state = ESPCONN_NONE;
-	ircd.tcp.local_port = port;
-	ircd.conn.proto.tcp = &ircd.tcp;
+	bzero(&ircd, sizeof(ircd));
 
 	espconn_tcp_set_max_con(MAX_USERS + 1);
-	espconn_regist_connectcb(&ircd.conn, (void (*)(void *))
-							 ircdClientConnectCb);
-	espconn_accept(&ircd.conn);
-	espconn_regist_time(&ircd.conn, PING_TIMEOUT + 60, 0);
-	espconn_tcp_set_max_con_allow(&ircd.conn, MAX_USERS + 1);
+	ircdListen(port);
+	for (cls = ircClasses; cls->name; cls++) {
+		for (i = 0; i < ircd.listeners; i++) {
+			if (ircd.listen[i].tcp.local_port == cls->port) {
+				break;
+			}
+		}
+		if (cls->port && i == ircd.listeners) {
+			ircdListen(cls->port);
+		}
+	}
 
+	ircd.clock_last = system_get_time();
+	ircd.heap_min = system_get_free_heap_size();
 	os_timer_disarm(&ircd.timer);
 	os_timer_setfn(&ircd.timer, ircdTimerCb, NULL);
-	os_timer_arm(&ircd.timer, 1000, 1);
+	os_timer_disarm(&ircd.flood_timer);
+	os_timer_setfn(&ircd.flood_timer, ircdFloodTimerCb, NULL);
+	ircdTimerRearm();
+}
+
+size_t ICACHE_FLASH_ATTR
+ircdStackPeak(void)
+{
+	return ircd.stack_peak;
+}
+
+size_t ICACHE_FLASH_ATTR
+ircdScratchPeak(void)
+{
+	return ircd.scratch_peak;
+}
+
+
+/*
+ * Serial console entry points.  They run from the console task, outside
+ * any SDK callback, so each one opens and closes its own event.
+ */
+void ICACHE_FLASH_ATTR
+ircdPrintStats(void)
+{
+	int i, users = 0, registered = 0, opers = 0, chans = 0;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	for (i = 0; i < MAX_USERS; i++) {
+		if (!(ircd.users[i].flags & USER_FLAG_CONNECTED)) {
+			continue;
+		}
+		users++;
+		if (ircd.users[i].flags & USER_FLAG_REGISTERED) {
+			registered++;
+		}
+		if (ircd.users[i].flags & USER_FLAG_OPERATOR) {
+			opers++;
+		}
+	}
+	for (i = 0; i < MAX_CHANS; i++) {
+		if (ircd.chans[i].users) {
+			chans++;
+		}
+	}
+
+	printf("uptime %u s\n", (unsigned int)ircd.now);
+	printf("users %d/%d (%d registered, %d opers), channels %d/%d\n", users,
+	       MAX_USERS, registered, opers, chans, MAX_CHANS);
+	printf("heap %u free (%u min, %u allocation failures), stack peak %u, "
+	       "scratch peak %u (%u overflows)\n",
+	       (unsigned int)system_get_free_heap_size(),
+	       (unsigned int)ircd.heap_min, (unsigned int)ircd.alloc_fails,
+	       (unsigned int)ircd.stack_peak, (unsigned int)ircd.scratch_peak,
+	       (unsigned int)ircd.scratch_overflows);
+	printf("log level %d, %u records dropped\n", log_get_level(),
+	       (unsigned int)log_dropped());
+	ircdEventLeave();
+}
+
+void ICACHE_FLASH_ATTR
+ircdPrintConnections(void)
+{
+	IrcUser *user;
+	char mode[8];
+	int i;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	for (i = 0; i < MAX_USERS; i++) {
+		user = &ircd.users[i];
+		if (!(user->flags & USER_FLAG_CONNECTED)) {
+			continue;
+		}
+
+		ircUserFlagsToMode(mode, user->flags, user->flags &
+		                   (USER_FLAG_WALLOPS | USER_FLAG_INVISIBLE |
+		                    USER_FLAG_OPERATOR));
+		printf("u%2d %-9s " IPSTR ":%d %-7s %s on %us idle %us rtt %u%s\n",
+		       i, user->nick[0] ? user->nick : "*", IP2STR(&user->remote_ip),
+		       user->remote_port, user->cls->name, mode[0] ? mode : "+",
+		       (unsigned int)(ircd.now - user->connect_time),
+		       (unsigned int)(ircd.now - user->last_recv), user->srtt,
+		       (user->flags & USER_FLAG_DETACHED) ? " detached" :
+		       !(user->flags & USER_FLAG_REGISTERED) ? " unregistered" :
+		       user->msgbuf ? "" : " asleep");
+	}
+	ircdEventLeave();
+}
+
+bool ICACHE_FLASH_ATTR
+ircdKill(const char *nick, const char *reason)
+{
+	IrcUser *user;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	user = ircFindUserByNick(nick);
+	if (user) {
+		ircDisconnect(user, "QUIT", "Killed: ", reason);
+	}
+
+	ircdEventLeave();
+	return user != NULL;
+}
+
+void ICACHE_FLASH_ATTR
+ircdWallops(const char *text)
+{
+	IrcUser *user;
+	char *buf;
+	int i;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	buf = ircScratchAlloc(MSGLEN + 1);
+	if (!buf) {
+		goto leave;
+	}
+	snprintf(buf, MSGLEN + 1, ":%s WALLOPS :%s", wifi_station_get_hostname(),
+	         text);
+	for (i = 0; i < MAX_USERS; i++) {
+		user = &ircd.users[i];
+		if ((user->flags & (USER_FLAG_CONNECTED | USER_FLAG_WALLOPS)) !=
+		    (USER_FLAG_CONNECTED | USER_FLAG_WALLOPS)) {
+			continue;
+		}
+
+		ircSend(user, buf);
+	}
+
+leave:
+	ircdEventLeave();
+}
+
+static void ICACHE_FLASH_ATTR
+ircMetric(void (*emit)(const char *text), char *buf, const char *name,
+          const char *type, uint32 value)
+{
+	snprintf(buf, MSGLEN + 1, "# TYPE espircd_%s %s\nespircd_%s %u\n", name,
+	         type, name, (unsigned int)value);
+	emit(buf);
 }
 
+/*
+ * Prometheus text exposition for the metrics listener.  The page goes
+ * out a few lines at a time through emit, so nothing holds all of it.
+ */
+void ICACHE_FLASH_ATTR
+ircdMetrics(void (*emit)(const char *text))
+{
+	int i, users = 0, registered = 0, chans = 0, held = 0;
+	IrcCommand *cmd;
+	IrcUser *user;
+	char *buf;
+
+	ircdEventEnter(__builtin_frame_address(0));
+
+	for (i = 0; i < MAX_USERS; i++) {
+		if (!(ircd.users[i].flags & USER_FLAG_CONNECTED)) {
+			continue;
+		}
+		users++;
+		if (ircd.users[i].flags & USER_FLAG_REGISTERED) {
+			registered++;
+		}
+	}
+	for (i = 0; i < MAX_CHANS; i++) {
+		if (ircd.chans[i].users) {
+			chans++;
+		}
+	}
+	for (i = 0; i < FLOOD_HOLD_SLOTS; i++) {
+		if (ircd.flood[i].user) {
+			held++;
+		}
+	}
+
+	buf = ircScratchAlloc(MSGLEN + 1);
+	if (!buf) {
+		goto leave;
+	}
+	ircMetric(emit, buf, "uptime_seconds", "counter", ircd.now);
+	ircMetric(emit, buf, "connections", "gauge", users);
+	ircMetric(emit, buf, "connections_total", "counter", ircd.connects);
+	ircMetric(emit, buf, "registered_users", "gauge", registered);
+	ircMetric(emit, buf, "channels", "gauge", chans);
+	ircMetric(emit, buf, "lines_received_total", "counter", ircd.lines_in);
+	ircMetric(emit, buf, "bytes_received_total", "counter", ircd.bytes_in);
+	ircMetric(emit, buf, "lines_sent_total", "counter", ircd.lines_out);
+	ircMetric(emit, buf, "bytes_sent_total", "counter", ircd.bytes_out);
+	ircMetric(emit, buf, "timeouts_total", "counter", ircd.timeouts);
+	ircMetric(emit, buf, "flood_held", "gauge", held);
+	ircMetric(emit, buf, "heap_free_bytes", "gauge",
+	          system_get_free_heap_size());
+	ircMetric(emit, buf, "heap_min_free_bytes", "gauge", ircd.heap_min);
+	ircMetric(emit, buf, "alloc_failures_total", "counter",
+	          ircd.alloc_fails);
+	ircMetric(emit, buf, "scratch_overflows_total", "counter",
+	          ircd.scratch_overflows);
+
+	emit("# TYPE espircd_sendq_lines gauge\n");
+	for (i = 0; i < MAX_USERS; i++) {
+		user = &ircd.users[i];
+		if (!(user->flags & USER_FLAG_CONNECTED)) {
+			continue;
+		}
+
+		snprintf(buf, MSGLEN + 1, "espircd_sendq_lines{client=\"u%d\"} %u\n",
+		         i, user->sendq);
+		emit(buf);
+	}
+
+	emit("# TYPE espircd_commands_total counter\n");
+	for (cmd = userCommands; cmd->name; cmd++) {
+		snprintf(buf, MSGLEN + 1, "espircd_commands_total{command=\"%s\"} "
+		         "%u\n", cmd->name, (unsigned int)cmd->calls);
+		emit(buf);
+	}
+
+	emit("# TYPE espircd_command_errors_total counter\n");
+	for (cmd = userCommands; cmd->name; cmd++) {
+		snprintf(buf, MSGLEN + 1, "espircd_command_errors_total{"
+		         "command=\"%s\"} %u\n", cmd->name,
+		         (unsigned int)cmd->errors);
+		emit(buf);
+	}
+
+leave:
+	ircdEventLeave();
+}
@@ -2,14 +2,35 @@
 #define IRCD_H
 
 #define ESPIRCDVERSION "espircd0.1"
+// shown in 003 and INFO; the host build fixes it so transcripts repeat
+#ifndef BUILD_DATE
+#define BUILD_DATE __DATE__
+#define BUILD_TIME __TIME__
+#endif
 
 #define OPER_NAME "name"
 #define OPER_PASSWORD "password"
 
-// SDK limit of 15 connections, but we can run out of heap with just 6
+// SDK limit of 15 connections, but we can run out of heap with just 6;
+// check the heap minimum in STATS z under load before raising it
 #define MAX_USERS 5
+#if MAX_USERS > 32
+#error "per-message recipient masks are 32 bits wide"
+#endif
+// receive buffers; clients idle for HIBERNATE_IDLE seconds give theirs
+// back, so only the talkative ones pay for one.  A client without one is
+// still served whole lines; with no buffer or hold buffer left, the ones
+// without wait, held, until one frees
+#define MAX_AWAKE 2
+#define HIBERNATE_IDLE 60
 #define MAX_CHANS 4
 #define MAX_PARAM 15
+#define MAXTARGETS 4
+#define MAX_SILENCE 4
+#define MAX_MONITOR 8
+#define MONITOR_SLOTS 16
+// the main port plus any other port named in the class table
+#define MAX_LISTEN 2
 
 #define MSGLEN 510
 #define USERLEN 10
@@ -17,10 +38,72 @@
 #define REALLEN 50
 #define CHANLEN 49
 #define TOPICLEN 307
+#define MASKLEN (NICKLEN + USERLEN + 17)
 
 #define UNREGISTERED_TIMEOUT 30
+// unregistered clients may fill this share of the slots not taken by
+// registered ones, but always at least MIN_UNREGISTERED; beyond it the
+// oldest one that has had UNREGISTERED_GRACE seconds to register is shed
+#define UNREGISTERED_PCT 75
+#define MIN_UNREGISTERED 2
+#define UNREGISTERED_GRACE 5
+// connects allowed per address within THROTTLE_WINDOW seconds
+#define THROTTLE_SLOTS 8
+#define THROTTLE_WINDOW 60
+#define THROTTLE_MAX 4
+// keepalive interval, doubled after each timely PONG up to PING_TIME_MAX;
+// these are class defaults, and no class may exceed PING_TIME_MAX
 #define PING_TIME 90
-#define PING_TIMEOUT 180
+#define PING_TIME_MAX 360
+// PONG grace period, PONG_WAIT_MIN plus 16 RTO, capped at PONG_WAIT_MAX
+#define PONG_WAIT_MIN 30
+#define PONG_WAIT_MAX 180
+// longest silence any client can get away with
+#define PING_TIMEOUT (PING_TIME_MAX + PONG_WAIT_MAX)
+
+// lwIP keepalive probing replaces PINGs for clients that don't ask for them
+#define TCP_KEEPIDLE 120
+#define TCP_KEEPINTVL 15
+#define TCP_KEEPCNT 4
+
+// command flood control: a bucket of FLOOD_BURST lines refilled at
+// FLOOD_RATE lines per second; excess input waits in one of the shared
+// hold buffers, or with none free in the network stack, and a client held
+// for FLOOD_HOLD_MAX seconds is dropped
+#define FLOOD_BURST 10
+#define FLOOD_RATE 2
+// lines still unacknowledged from earlier events before a client counts
+// as not keeping up; above the longest reply, STATS m at 29 lines
+#define SENDQ_LINES 32
+#define FLOOD_BUFLEN (2 * (MSGLEN + 2))
+#define FLOOD_HOLD_SLOTS 2
+#define FLOOD_HOLD_MAX 20
+#define FLOOD_HOLD_GAP 2
+#define FLOOD_TICK 250
+
+// a dropped client holding the resume cap keeps its session this long,
+// with missed lines kept in one of the shared replay buffers
+#define RESUME_GRACE 60
+#define RESUME_SLOTS 2
+#define RESUME_BUFLEN 1024
+
+// latency histograms: bucket 0 is under 2^HIST_SHIFT us, each next one
+// doubles up to about 2 s, and the last is an overflow bucket for the rest
+#define HIST_BUCKETS 16
+#define HIST_SHIFT 7
+
+// opers get a notice when free heap drops below this, and another only
+// after it has climbed a quarter above it again
+#define HEAP_ALERT 8192
+
+// one second buckets; a power of two
+#define WHEEL_SLOTS 16
+// longest sleep with no deadlines, keeps the clock ahead of the us wrap
+#define CLOCK_UPKEEP 3600
+
+// per-event formatting buffers: handler + disconnect + notice + send, and
+// the line being read for a client that could not get a receive buffer
+#define SCRATCH_SIZE (5 * (MSGLEN + 4))
 
 #define USER_FLAG_CONNECTED  0x0001
 #define USER_FLAG_REGISTERED 0x0002
@@ -28,6 +111,16 @@
 #define USER_FLAG_WALLOPS    0x0008
 #define USER_FLAG_INVISIBLE  0x0010
 #define USER_FLAG_OPERATOR   0x0020
+#define USER_FLAG_CAPNEG     0x0040
+#define USER_FLAG_KEEPALIVE  0x0080
+#define USER_FLAG_SENDQ      0x0100
+#define USER_FLAG_DETACHED   0x0200
+#define USER_FLAG_BLOCKED    0x0400 // a send was refused, input waits
+#define USER_FLAG_THROTTLED  0x0800 // over budget, input waits for tokens
+
+#define USER_CAP_COMPACT     0x01
+#define USER_CAP_PING        0x02
+#define USER_CAP_RESUME      0x04
 
 #define CHAN_FLAG_SECRET     0x0001
 #define CHAN_FLAG_MODERATED  0x0002
@@ -44,18 +137,56 @@ typedef struct IrcUser IrcUser;
 typedef struct IrcChan IrcChan;
 typedef struct IrcMessage IrcMessage;
 typedef struct IrcCommand IrcCommand;
+typedef struct IrcCap IrcCap;
+typedef struct IrcMonitor IrcMonitor;
+typedef struct IrcThrottle IrcThrottle;
+typedef struct IrcFlood IrcFlood;
+typedef struct IrcClass IrcClass;
+typedef struct IrcListener IrcListener;
+typedef struct IrcReplay IrcReplay;
+typedef struct IrcHist IrcHist;
 
 struct IrcUser {
 	uint8 remote_ip[4];
 	uint16 remote_port;
 	unsigned char index;
-	char msgbuf[MSGLEN + 1];
+	unsigned char listener;
+	IrcClass *cls;
+	uint16 sendq;
+	uint16 sendq_mark; // of sendq, the lines from earlier events
+	char *msgbuf; // NULL while hibernating
+	uint32 line_us; // when the first byte in msgbuf arrived
 	char user[USERLEN + 1];
 	char nick[NICKLEN + 1];
 	char real[REALLEN + 1];
+	char silence[MAX_SILENCE][MASKLEN + 1];
 	uint16 flags;
-	unsigned char last_recv;
+	uint8 caps;
+	uint8 monitors;
+	uint32 connect_time;
+	uint32 last_recv;
 	bool sent_ping;
+	uint16 ping_interval;
+	uint32 ping_sent;
+	uint16 srtt;
+	uint16 rttvar;
+	uint32 deadline;
+	IrcUser *timer_next;
+	IrcUser **timer_pprev;
+	sint32 flood_tokens; // thousandths of a line
+	uint32 flood_stamp;
+	uint32 flood_since;
+	uint32 flood_unheld;
+	IrcFlood *flood;
+	uint32 resume_token[2];
+	IrcReplay *replay;
+	uint32 lines_in; // traffic since connect
+	uint32 bytes_in;
+	uint32 lines_out;
+	uint32 bytes_out;
+	uint16 send_fails;
+	uint16 drops;
+	uint16 sendq_peak;
 };
 
 struct IrcChan {
@@ -66,12 +197,98 @@ struct IrcChan {
 	uint16 flags;
 };
 
-struct Ircd {
+// reverse index: one slot per watched nick, free when nobody watches it
+struct IrcMonitor {
+	char nick[NICKLEN + 1];
+	uint32 watchers;
+};
+
+struct IrcClass {
+	char *name;
+	uint8 ip[4];
+	uint8 prefix;       // significant bits of ip, 0 for any address
+	uint16 port;        // listen port, 0 for any
+	uint8 max_conns;
+	uint8 reserved;     // slots other classes may not take
+	uint16 sendq;       // backlog in lines before the client is dropped
+	uint16 ping_time;
+	uint16 ping_time_max;
+	uint8 flood_burst;
+	uint8 flood_rate;
+};
+
+struct IrcListener {
 	struct espconn conn;
 	esp_tcp tcp;
+};
+
+struct IrcHist {
+	uint16 bucket[HIST_BUCKETS]; // halved together when one saturates
+};
+
+struct IrcReplay {
+	IrcUser *user;
+	uint16 len;
+	char buf[RESUME_BUFLEN];
+};
+
+struct IrcFlood {
+	IrcUser *user;
+	uint16 len;
+	uint32 arrived_us; // of the oldest input held
+	char buf[FLOOD_BUFLEN];
+};
+
+struct IrcThrottle {
+	uint8 ip[4];
+	uint8 count;
+	uint32 since;
+};
+
+struct Ircd {
+	IrcListener listen[MAX_LISTEN];
+	unsigned char listeners;
 	ETSTimer timer;
 	IrcUser users[MAX_USERS];
 	IrcChan chans[MAX_CHANS];
+	IrcMonitor monitors[MONITOR_SLOTS];
+	IrcThrottle throttle[THROTTLE_SLOTS];
+	IrcFlood flood[FLOOD_HOLD_SLOTS];
+	ETSTimer flood_timer;
+	bool flood_armed;
+	IrcReplay replay[RESUME_SLOTS];
+	char rxbuf[MAX_AWAKE][MSGLEN + 1];
+	IrcUser *rxbuf_owner[MAX_AWAKE];
+	bool pool_full; // no receive or hold buffer free after the last event
+	IrcUser *wheel[WHEEL_SLOTS];
+	uint32 wheel_tick;
+	uint32 timer_deadline;
+	bool timer_armed;
+	bool timer_busy;
+	uint32 now;
+	uint32 clock_last;
+	uint32 clock_us;
+	char scratch[SCRATCH_SIZE];
+	size_t scratch_used;
+	size_t scratch_peak;
+	unsigned int scratch_overflows;
+	void *stack_base;
+	size_t stack_peak;
+	uint16 event_lines;
+	uint16 error_replies;
+	uint32 event_us;
+	uint32 input_us; // when the input being read arrived
+	uint32 sent_us;
+	IrcHist fanout;
+	uint32 connects; // totals since boot
+	uint32 timeouts;
+	uint32 lines_in;
+	uint32 bytes_in;
+	uint32 lines_out;
+	uint32 bytes_out;
+	uint32 heap_min;
+	bool heap_low;
+	uint32 alloc_fails; // pool misses and out of memory sends
 };
 
 struct IrcMessage {
@@ -85,9 +302,28 @@ struct IrcCommand {
 	char *name;
 	unsigned char required_params;
 	bool for_registration;
+	unsigned char cost;
 	void (*handler)(IrcUser *client, IrcMessage *msg);
+	uint32 calls;      // exported as counters, so never reset;
+	uint32 errors;     // STATS m RESET moves the baselines instead
+	uint32 base_calls;
+	uint32 base_errors;
+	uint32 handler_us; // since STATS m RESET; wraps after about 71 minutes
+	IrcHist latency;
+};
+
+struct IrcCap {
+	char *name;
+	uint8 flag;
 };
 
 void ICACHE_FLASH_ATTR ircdInit(int port);
+size_t ICACHE_FLASH_ATTR ircdStackPeak(void);
+size_t ICACHE_FLASH_ATTR ircdScratchPeak(void);
+void ICACHE_FLASH_ATTR ircdPrintStats(void);
+void ICACHE_FLASH_ATTR ircdPrintConnections(void);
+bool ICACHE_FLASH_ATTR ircdKill(const char *nick, const char *reason);
+void ICACHE_FLASH_ATTR ircdWallops(const char *text);
+void ICACHE_FLASH_ATTR ircdMetrics(void (*emit)(const char *text));
 
 #endif /* IRCD_H */
@@ -8,7 +8,10 @@
  */
 
 #include <esp8266.h>
+#include "console.h"
+#include "governor.h"
 #include "ircd.h"
+#include "metrics.h"
 
 //#define SHOW_HEAP_USE
 
@@ -18,7 +21,9 @@ static ETSTimer prHeapTimer;
 static void ICACHE_FLASH_ATTR
 prHeapTimerCb(void *arg)
 {
-	printf("Heap: %ld\n", (unsigned long)system_get_free_heap_size());
+	printf("Heap: %ld, stack peak: %d, scratch peak: %d\n",
+	       (unsigned long)system_get_free_heap_size(), (int)ircdStackPeak(),
+	       (int)ircdScratchPeak());
 }
 #endif
 
@@ -28,13 +33,16 @@ user_init(void)
 	stdout_init();
 	printf("\n");
 
+	govInit(NULL);
 	ircdInit(6667);
+	metricsInit(METRICS_PORT);
+	consoleInit();
 #ifdef SHOW_HEAP_USE
 	os_timer_disarm(&prHeapTimer);
 	os_timer_setfn(&prHeapTimer, prHeapTimerCb, NULL);
 	os_timer_arm(&prHeapTimer, 3000, 1);
 #endif
-	printf("\nReady\n");
+	printf("\nReady\n> ");
 }
 
 #ifndef USE_OPENSDK
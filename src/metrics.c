@@ -0,0 +1,159 @@
+#include <esp8266.h>
+#include "ircd.h"
+#include "metrics.h"
+
+/*
+ * Prometheus scrape endpoint.  One scrape at a time on its own port, so
+ * monitoring never takes an IRC slot.  Any GET is answered with the
+ * whole page over HTTP/1.0 and the connection is closed once the last
+ * piece has been acknowledged.  A second scraper arriving meanwhile is
+ * told to come back later rather than left waiting.
+ */
+
+typedef struct Metrics Metrics;
+struct Metrics {
+	struct espconn conn;
+	esp_tcp tcp;
+	struct espconn *client;
+	uint8 client_ip[4];
+	int client_port;
+	char chunk[METRICS_CHUNK];
+	size_t len;
+	uint8 pending;
+	bool failed;
+};
+
+static Metrics metrics;
+
+static void ICACHE_FLASH_ATTR
+metricsFlush(void)
+{
+	if (!metrics.len || metrics.failed) {
+		return;
+	}
+
+	if (espconn_sent(metrics.client, (uint8 *)metrics.chunk, metrics.len) !=
+		ESPCONN_OK) {
+		metrics.failed = true;
+	} else {
+		metrics.pending++;
+	}
+	metrics.len = 0;
+}
+
+static void ICACHE_FLASH_ATTR
+metricsEmit(const char *text)
+{
+	size_t len = strlen(text);
+
+	if (metrics.len + len > METRICS_CHUNK) {
+		metricsFlush();
+	}
+	memcpy(metrics.chunk + metrics.len, text, len);
+	metrics.len += len;
+}
+
+// callbacks may pass a different espconn, so match on the remote end
+static bool ICACHE_FLASH_ATTR
+metricsIsClient(struct espconn *conn)
+{
+	return metrics.client &&
+	       memcmp(conn->proto.tcp->remote_ip, metrics.client_ip, 4) == 0 &&
+	       conn->proto.tcp->remote_port == metrics.client_port;
+}
+
+static void ICACHE_FLASH_ATTR
+metricsRecvCb(struct espconn *conn, char *data, unsigned short len)
+{
+	static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\n"
+	                           "Retry-After: 1\r\n"
+	                           "Connection: close\r\n\r\n";
+
+	if (metricsIsClient(conn)) {
+		return;
+	}
+	if (metrics.client) {
+		if (espconn_sent(conn, (uint8 *)busy, sizeof(busy) - 1) !=
+		    ESPCONN_OK) {
+			espconn_disconnect(conn);
+		}
+		return;
+	}
+
+	metrics.client = conn;
+	memcpy(metrics.client_ip, conn->proto.tcp->remote_ip, 4);
+	metrics.client_port = conn->proto.tcp->remote_port;
+	metrics.len = 0;
+	metrics.pending = 0;
+	metrics.failed = false;
+
+	if (len < 4 || strncmp(data, "GET ", 4) != 0) {
+		metricsEmit("HTTP/1.0 405 Method Not Allowed\r\n"
+		            "Connection: close\r\n\r\n");
+	} else {
+		metricsEmit("HTTP/1.0 200 OK\r\n"
+		            "Content-Type: text/plain; version=0.0.4\r\n"
+		            "Connection: close\r\n\r\n");
+		ircdMetrics(metricsEmit);
+	}
+	metricsFlush();
+
+	if (!metrics.pending) {
+		espconn_disconnect(conn);
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+metricsSentCb(struct espconn *conn)
+{
+	if (!metricsIsClient(conn)) {
+		espconn_disconnect(conn); // the 503 is out
+	} else if (metrics.pending && !--metrics.pending) {
+		espconn_disconnect(conn);
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+metricsDisconnectCb(struct espconn *conn)
+{
+	if (metricsIsClient(conn)) {
+		metrics.client = NULL;
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+metricsReconCb(struct espconn *conn, sint8 err)
+{
+	if (metricsIsClient(conn)) {
+		metrics.client = NULL;
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+metricsConnectCb(struct espconn *conn)
+{
+	espconn_regist_recvcb(conn, (void (*)(void *, char *, unsigned short))
+	                      metricsRecvCb);
+	espconn_regist_sentcb(conn, (void (*)(void *))metricsSentCb);
+	espconn_regist_disconcb(conn, (void (*)(void *))metricsDisconnectCb);
+	espconn_regist_reconcb(conn, (void (*)(void *, sint8))metricsReconCb);
+}
+
+void ICACHE_FLASH_ATTR
+metricsInit(int port)
+{
+	bzero(&metrics, sizeof(metrics));
+
+	metrics.conn.type = ESPCONN_TCP;
+	metrics.conn.state = ESPCONN_NONE;
+	metrics.tcp.local_port = port;
+	metrics.conn.proto.tcp = &metrics.tcp;
+
+	// room for one scrape and one turned away, on top of the IRC connections
+	espconn_tcp_set_max_con(espconn_tcp_get_max_con() + 2);
+	espconn_regist_connectcb(&metrics.conn, (void (*)(void *))
+	                         metricsConnectCb);
+	espconn_accept(&metrics.conn);
+	espconn_regist_time(&metrics.conn, 10, 0);
+	espconn_tcp_set_max_con_allow(&metrics.conn, 2);
+}
@@ -0,0 +1,9 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_PORT 9100
+#define METRICS_CHUNK 1024 // page is sent in pieces of up to this much
+
+void ICACHE_FLASH_ATTR metricsInit(int port);
+
+#endif /* METRICS_H */
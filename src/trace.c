@@ -0,0 +1,114 @@
+#include <esp8266.h>
+#include "trace.h"
+
+#ifdef TRACE_ENABLE
+
+/*
+ * Event tracing.  Begin/end pairs go into a fixed ring that overwrites
+ * its oldest entries, and come back out as Chrome trace JSON for
+ * chrome://tracing or ui.perfetto.dev.  Recording an event is a
+ * timestamp and four stores; names must be string constants.
+ */
+
+typedef struct TraceEntry TraceEntry;
+struct TraceEntry {
+	uint32 ts;
+	const char *name;
+	uint16 arg;
+	char ph;
+};
+
+typedef struct Trace Trace;
+struct Trace {
+	TraceEntry ring[TRACE_SLOTS];
+	uint16 head;
+	uint16 count;
+	bool on;
+};
+
+static Trace trace;
+
+void ICACHE_FLASH_ATTR
+traceEvent(char ph, const char *name, int arg)
+{
+	TraceEntry *entry;
+
+	if (!trace.on) {
+		return;
+	}
+
+	entry = &trace.ring[trace.head];
+	entry->ts = system_get_time();
+	entry->name = name;
+	entry->arg = arg;
+	entry->ph = ph;
+
+	trace.head = (trace.head + 1) % TRACE_SLOTS;
+	if (trace.count < TRACE_SLOTS) {
+		trace.count++;
+	}
+}
+
+void ICACHE_FLASH_ATTR
+traceStart(void)
+{
+	trace.head = 0;
+	trace.count = 0;
+	trace.on = true;
+}
+
+void ICACHE_FLASH_ATTR
+traceStop(void)
+{
+	trace.on = false;
+}
+
+uint16 ICACHE_FLASH_ATTR
+traceCount(void)
+{
+	return trace.count;
+}
+
+/*
+ * Line n of the dump, counting from 0: the opening, one event per line
+ * with times relative to the oldest event, then the closing.  Returns
+ * false past the end.  Tracing should be stopped while a dump is read.
+ */
+bool ICACHE_FLASH_ATTR
+traceDumpLine(uint16 n, char *buf, size_t len)
+{
+	uint16 first = (trace.head + TRACE_SLOTS - trace.count) % TRACE_SLOTS;
+	TraceEntry *entry;
+
+	if (n == 0) {
+		snprintf(buf, len, "{\"traceEvents\":[\n");
+		return true;
+	}
+	if (n == trace.count + 1) {
+		snprintf(buf, len, "]}\n");
+		return true;
+	}
+	if (n > trace.count + 1) {
+		return false;
+	}
+
+	entry = &trace.ring[(first + n - 1) % TRACE_SLOTS];
+	snprintf(buf, len, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%u,\"pid\":1,"
+	         "\"tid\":1,\"args\":{\"arg\":%u}}%s\n", entry->name, entry->ph,
+	         (unsigned int)(entry->ts - trace.ring[first].ts), entry->arg,
+	         n < trace.count ? "," : "");
+	return true;
+}
+
+void ICACHE_FLASH_ATTR
+traceDump(void (*emit)(const char *text))
+{
+	char buf[TRACE_LINELEN];
+	uint16 n;
+
+	for (n = 0; traceDumpLine(n, buf, sizeof(buf)); n++) {
+		emit(buf);
+	}
+}
+
+#endif /* TRACE_ENABLE */
@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// build with TRACE=1, or uncomment, for event tracing; the ring takes 12
+// bytes a slot
+//#define TRACE_ENABLE
+#define TRACE_SLOTS 256
+#define TRACE_LINELEN 128 // longest line of the JSON dump
+
+#ifdef TRACE_ENABLE
+#define TRACE_BEGIN(name, arg) traceEvent('B', (name), (arg))
+#define TRACE_END(name, arg) traceEvent('E', (name), (arg))
+#else
+#define TRACE_BEGIN(name, arg) do { } while (0)
+#define TRACE_END(name, arg) do { } while (0)
+#endif
+
+void ICACHE_FLASH_ATTR traceEvent(char ph, const char *name, int arg);
+void ICACHE_FLASH_ATTR traceStart(void);
+void ICACHE_FLASH_ATTR traceStop(void);
+uint16 ICACHE_FLASH_ATTR traceCount(void);
+bool ICACHE_FLASH_ATTR traceDumpLine(uint16 n, char *buf, size_t len);
+void ICACHE_FLASH_ATTR traceDump(void (*emit)(const char *text));
+
+#endif /* TRACE_H */